@@ -1,281 +1,6618 @@
+#include <cctype>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <csignal>
-#include <iostream>
+#include <expected>
+#include <filesystem>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <string>
 #include <print>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <format>
+#include <chrono>
+#include <initializer_list>
+#include <limits>
+#include <random>
+#include <regex>
+#include <span>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+    #include <immintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <leveldb/cache.h>
+#include <leveldb/comparator.h>
 #include <leveldb/db.h>
+#include <leveldb/env.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/table.h>
+#include <leveldb/table_builder.h>
+#include <leveldb/write_batch.h>
 #include <oryx/crt/enchantum.hpp>
 
 using std::print;
 using std::println;
-using ArgsVector = std::vector<std::string_view>;
+using ArgsVector = std::span<const std::string_view>;
+namespace fs = std::filesystem;
+
+enum class Instruction : uint8_t {
+    help,
+    exit,
+    open,
+    close,
+    read,
+    write,
+    dump,
+    remove,
+    begin,
+    commit,
+    rollback,
+    set,
+    stats,
+    import,
+    export_,
+    scan,
+    prefix,
+    bench,
+    timing,
+    mget,
+    count,
+    compact,
+    size,
+    delrange,
+    delprefix,
+    snapshot,
+    release,
+    use,
+    diff,
+    analyze,
+    jobs,
+    cancel,
+    backup,
+    watch,
+    repair,
+    verify,
+};
+enum class SyncMode : uint8_t { off, on, every, interval };
+enum class RecordFormat : uint8_t { text, csv, tsv, ndjson };
+enum class DiffKind : uint8_t { same, only_a, only_b, changed };
+enum class Codec : uint8_t { raw, hex, tuple, varint, msgpack, protobuf };
+enum class Benchmark : uint8_t { fillseq, fillrandom, readrandom, readseq, deleterandom, seekrandom };
 
-enum class Instruction : uint8_t { help, exit, open, close, read, write, dump, remove };
+// Rearranges a table with one entry per enumerator, listed in any order, into an array indexed by the enum value.
+// Missing or repeated enumerators fail at compile time.
+template <typename E, typename T, size_t N>
+constexpr auto MakeDenseTable(const std::array<std::pair<E, T>, N>& table) {
+    std::array<T, enchantum::count<E>> dense{};
+    std::array<bool, enchantum::count<E>> seen{};
+    for (const auto& [key, value] : table) {
+        const auto index = static_cast<size_t>(key);
+        if (seen[index]) throw "enumerator listed twice";
+        seen[index] = true;
+        dense[index] = value;
+    }
+    if (std::ranges::find(seen, false) != seen.end()) throw "enumerator missing from the table";
+    return dense;
+}
 
 struct InstructionInfo {
     using ImplFn = void (*)(const ArgsVector&);
     struct Arguments {
+        static constexpr size_t kUnbounded = std::numeric_limits<size_t>::max();
+
         std::string_view data;
         size_t size;
+        size_t optional = 0;  // Additional arguments accepted on top of size
     };
 
     std::string_view description;
     Arguments args;
     ImplFn impl;
     bool require_db = false;
+    std::string_view aliases = {};  // Space separated extra names, resolved like the instruction's own
+    bool writes = false;            // Rejected while the db is a read-only copy
+    bool background = false;        // May run as a job with a trailing &
 };
 
-std::unique_ptr<leveldb::DB> database;
+struct PendingBatch {
+    leveldb::WriteBatch batch;
+    size_t ops = 0;
+    size_t max_ops = 0;    // Auto-flush after this many ops, 0 disables
+    size_t max_bytes = 0;  // Auto-flush once the batch grows past this size, 0 disables
+};
 
-constexpr auto ViewToSlice(std::string_view view) -> leveldb::Slice;
-constexpr auto GetInfo(Instruction inst) -> const InstructionInfo&;
+std::atomic<uint64_t> error_count = 0;
+thread_local uint64_t thread_error_count = 0;  // Errors of the calling thread only, for background jobs
+bool script_mode = false;
 
-struct ExitFunctor {
-    void operator()() const {
-        database.reset();
-        std::exit(EXIT_SUCCESS);
+// Every error goes through here so script mode can exit with a failure code
+template <typename... Args>
+void PrintError(std::format_string<Args...> fmt, Args&&... args) {
+    error_count++;
+    thread_error_count++;
+    println("error: {}", std::format(fmt, std::forward<Args>(args)...));
+}
+
+template <typename T>
+auto ParseNumber(std::string_view text, std::string_view what) -> std::optional<T> {
+    T value{};
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || ptr != text.data() + text.size()) {
+        PrintError("{} expected a number got '{}'", what, text);
+        return std::nullopt;
     }
-};
+    return value;
+}
 
-struct PrintHelpFunctor {
-    static constexpr auto kPrintFmt = "{:<15}{:<20}{:<20}";
+struct CommandArgs {
+    std::vector<std::string_view> positional;
+    std::vector<std::pair<std::string_view, std::string_view>> options;
 
-    void operator()() const {
-        println("Help\n");
-        println("Input format is: <instruction> <args>");
-        println("Example: open ./database.ldb\n");
-        println(kPrintFmt, "Instruction", "Arguments", "Description");
-        enchantum::for_each<Instruction>([&](auto c) {
-            const auto& info = GetInfo(c.value);
-            println(kPrintFmt, enchantum::to_string(c.value), info.args.data, info.description);
-        });
+    auto Has(std::string_view name) const -> bool {
+        return std::ranges::find(options, name, &std::pair<std::string_view, std::string_view>::first) !=
+               options.end();
     }
-};
 
-struct CloseFunctor {
-    void operator()() const {
-        database.reset();
-        println("OK");
+    auto Get(std::string_view name) const -> std::optional<std::string_view> {
+        auto it = std::ranges::find(options, name, &std::pair<std::string_view, std::string_view>::first);
+        if (it == options.end()) return std::nullopt;
+        return it->second;
     }
+
+    template <typename T>
+    auto GetNumber(std::string_view name, T fallback) const -> std::optional<T>;
 };
 
-struct DumpFunctor {
-    void operator()() const {
-        auto it = std::unique_ptr<leveldb::Iterator>(database->NewIterator(leveldb::ReadOptions()));
-        for (it->SeekToFirst(); it->Valid(); it->Next()) {
-            println("{}: {}", it->key().ToString(), it->value().ToString());
+// Decides which writes carry sync = true. every/interval group-commit: the writes of a group go out unsynced and
+// the last one syncs, which makes the whole log up to that point durable. An interval group that no further write
+// closes is synced by SyncDueGroup once its interval is over, at the prompt and before the next command.
+struct Durability {
+    using Clock = std::chrono::steady_clock;
+
+    SyncMode mode = SyncMode::on;
+    uint64_t every = 0;
+    std::chrono::milliseconds interval{};
+
+    uint64_t unsynced_ops = 0;
+    Clock::time_point last_sync = Clock::now();
+    uint64_t ops = 0;
+    uint64_t syncs = 0;
+    std::mutex mutex;  // Background jobs write too
+
+    auto NextWrite(size_t op_count) -> leveldb::WriteOptions {
+        std::lock_guard lock(mutex);
+        ops += op_count;
+        unsynced_ops += op_count;
+
+        leveldb::WriteOptions opts{};
+        switch (mode) {
+            case SyncMode::off:
+                break;
+            case SyncMode::on:
+                opts.sync = true;
+                break;
+            case SyncMode::every:
+                opts.sync = unsynced_ops >= every;
+                break;
+            case SyncMode::interval:
+                opts.sync = Clock::now() - last_sync >= interval;
+                break;
+        }
+
+        if (opts.sync) {
+            syncs++;
+            unsynced_ops = 0;
+            last_sync = Clock::now();
         }
+        return opts;
+    }
+
+    // Time left until the open interval group is due for its sync, nullopt without one
+    auto UntilDue() -> std::optional<Clock::duration> {
+        std::lock_guard lock(mutex);
+        if (mode != SyncMode::interval || unsynced_ops == 0) return std::nullopt;
+        return std::max(last_sync + interval - Clock::now(), Clock::duration::zero());
     }
 };
 
-struct OpenFunctor {
-    void operator()(const ArgsVector& args) const {
-        leveldb::Options opts{};
-        opts.create_if_missing = true;
-        opts.reuse_logs = true;
-        auto path = std::string(args[0]);
+using FilePtr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
 
-        const auto status = leveldb::DB::Open(opts, path, std::out_ptr(database));
-        if (!status.ok()) {
-            println("error: open {} status='{}'", path, status.ToString());
+// Hands out lines from large fread blocks without copying them. A returned view stays valid until the next call.
+// With a quote character set, newlines inside quotes do not end the line (multi-line CSV fields).
+class LineReader {
+public:
+    static constexpr size_t kBlockSize = 4 << 20;
+
+    explicit LineReader(std::FILE* file)
+        : file_(file),
+          buffer_(kBlockSize) {}
+
+    auto Next(char quote = '\0') -> std::optional<std::string_view> {
+        size_t scan_from = begin_;
+        bool quoted = false;
+        for (;;) {
+            const auto end = quote == '\0' ? FindNewline(scan_from) : FindUnquotedNewline(scan_from, quote, quoted);
+            if (end != end_) {
+                return Take(end, end + 1);
+            }
+
+            if (eof_) {
+                if (begin_ == end_) return std::nullopt;
+                return Take(end_, end_);
+            }
+
+            scan_from = end_ - begin_;
+            Refill();
+            scan_from += begin_;
         }
-        println("OK");
     }
+
+    auto bytes_read() const -> uint64_t { return bytes_read_; }
+    auto error() const -> bool { return std::ferror(file_) != 0; }
+
+private:
+    auto FindNewline(size_t from) const -> size_t {
+        const auto* found = static_cast<const char*>(std::memchr(buffer_.data() + from, '\n', end_ - from));
+        return found == nullptr ? end_ : static_cast<size_t>(found - buffer_.data());
+    }
+
+    auto FindUnquotedNewline(size_t from, char quote, bool& quoted) const -> size_t {
+        for (size_t i = from; i < end_; i++) {
+            if (buffer_[i] == quote) {
+                quoted = !quoted;
+            } else if (buffer_[i] == '\n' && !quoted) {
+                return i;
+            }
+        }
+        return end_;
+    }
+
+    auto Take(size_t end, size_t next) -> std::string_view {
+        auto line = std::string_view(buffer_.data() + begin_, end - begin_);
+        if (line.ends_with('\r')) line.remove_suffix(1);
+        begin_ = next;
+        return line;
+    }
+
+    // Moves the unfinished line to the front and reads the next block behind it
+    void Refill() {
+        const size_t pending = end_ - begin_;
+        if (begin_ != 0) {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, pending);
+        }
+        begin_ = 0;
+        end_ = pending;
+        if (buffer_.size() - end_ < kBlockSize / 2) {
+            buffer_.resize(buffer_.size() * 2);  // A single line larger than the block
+        }
+
+        const size_t n = std::fread(buffer_.data() + end_, 1, buffer_.size() - end_, file_);
+        end_ += n;
+        bytes_read_ += n;
+        eof_ = n == 0;
+    }
+
+    std::FILE* file_;
+    std::vector<char> buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    uint64_t bytes_read_ = 0;
+    bool eof_ = false;
 };
 
-struct WriteFunctor {
-    void operator()(const ArgsVector& args) const {
-        auto key = args[0];
-        auto value = args[1];
+struct Record {
+    std::string_view key;
+    std::string_view value;
+};
 
-        leveldb::WriteOptions opts{};
-        opts.sync = true;
-        const auto status = database->Put(opts, ViewToSlice(key), ViewToSlice(value));
-        if (!status.ok()) {
-            println("error: write {} {} status='{}'", key, value, status.ToString());
-            return;
+constexpr std::string_view kHexDigits = "0123456789abcdef";
+
+// The four hex digits of a \u escape at pos, advancing pos past them
+constexpr auto ParseHex4(std::string_view text, size_t& pos) -> std::optional<uint32_t> {
+    if (text.size() - pos < 4) return std::nullopt;
+    uint32_t code = 0;
+    const auto [ptr, ec] = std::from_chars(text.data() + pos, text.data() + pos + 4, code, 16);
+    if (ec != std::errc() || ptr != text.data() + pos + 4) return std::nullopt;
+    pos += 4;
+    return code;
+}
+
+constexpr void AppendUtf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+// Splits one line into key and value. Fields are views into the line unless they contain escapes, in which case they
+// are unescaped into scratch buffers that are reused for every record.
+class RecordParser {
+public:
+    constexpr explicit RecordParser(RecordFormat format)
+        : format_(format) {}
+
+    constexpr auto Parse(std::string_view line) -> std::expected<Record, std::string_view> {
+        switch (format_) {
+            case RecordFormat::csv:
+                return ParseCsv(line);
+            case RecordFormat::tsv:
+                return ParseTsv(line);
+            case RecordFormat::ndjson:
+                return ParseNdjson(line);
+            case RecordFormat::text:
+                break;
         }
-        println("OK");
+        return std::unexpected("unsupported format");
+    }
+
+private:
+    constexpr auto ParseCsv(std::string_view line) -> std::expected<Record, std::string_view> {
+        auto key = ParseCsvField(line, key_scratch_);
+        if (!key) return std::unexpected(key.error());
+        if (line.empty() || line.front() != ',') return std::unexpected("expected two comma separated fields");
+        line.remove_prefix(1);
+
+        auto value = ParseCsvField(line, value_scratch_);
+        if (!value) return std::unexpected(value.error());
+        if (!line.empty()) return std::unexpected("expected two comma separated fields");
+        return Record{*key, *value};
+    }
+
+    // Consumes one RFC 4180 field from the front of line
+    static constexpr auto ParseCsvField(std::string_view& line, std::string& scratch)
+        -> std::expected<std::string_view, std::string_view> {
+        if (line.empty() || line.front() != '"') {
+            const auto end = std::min(line.find(','), line.size());
+            auto field = line.substr(0, end);
+            line.remove_prefix(end);
+            return field;
+        }
+
+        const auto close = line.find('"', 1);
+        if (close == std::string_view::npos) return std::unexpected("unterminated quoted field");
+        if (close + 1 == line.size() || line[close + 1] != '"') {
+            auto field = line.substr(1, close - 1);
+            line.remove_prefix(close + 1);
+            return field;
+        }
+
+        // Doubled quotes inside the field, unescape them
+        scratch.clear();
+        for (size_t i = 1; i < line.size(); i++) {
+            if (line[i] != '"') {
+                scratch.push_back(line[i]);
+                continue;
+            }
+            if (i + 1 < line.size() && line[i + 1] == '"') {
+                scratch.push_back('"');
+                i++;
+                continue;
+            }
+            line.remove_prefix(i + 1);
+            return scratch;
+        }
+        return std::unexpected("unterminated quoted field");
+    }
+
+    constexpr auto ParseTsv(std::string_view line) -> std::expected<Record, std::string_view> {
+        const auto tab = line.find('\t');
+        if (tab == std::string_view::npos) return std::unexpected("expected two tab separated fields");
+
+        auto key = UnescapeTsv(line.substr(0, tab), key_scratch_);
+        if (!key) return std::unexpected(key.error());
+        auto value = UnescapeTsv(line.substr(tab + 1), value_scratch_);
+        if (!value) return std::unexpected(value.error());
+        return Record{*key, *value};
+    }
+
+    // Tabs, newlines and backslashes inside fields are written as \t, \n, \r and \\ escapes
+    static constexpr auto UnescapeTsv(std::string_view field, std::string& scratch)
+        -> std::expected<std::string_view, std::string_view> {
+        if (field.find('\\') == std::string_view::npos) return field;
+
+        scratch.clear();
+        for (size_t i = 0; i < field.size(); i++) {
+            if (field[i] != '\\') {
+                scratch.push_back(field[i]);
+                continue;
+            }
+            if (++i == field.size()) return std::unexpected("dangling escape");
+            switch (field[i]) {
+                case 't':
+                    scratch.push_back('\t');
+                    break;
+                case 'n':
+                    scratch.push_back('\n');
+                    break;
+                case 'r':
+                    scratch.push_back('\r');
+                    break;
+                case '\\':
+                    scratch.push_back('\\');
+                    break;
+                default:
+                    return std::unexpected("unknown escape");
+            }
+        }
+        return scratch;
+    }
+
+    // Accepts {"key": "...", "value": ...}. A value that is not a JSON string is stored as its raw JSON text.
+    constexpr auto ParseNdjson(std::string_view line) -> std::expected<Record, std::string_view> {
+        std::optional<std::string_view> key;
+        std::optional<std::string_view> value;
+
+        size_t pos = 0;
+        if (!Expect(line, pos, '{')) return std::unexpected("expected a json object");
+        if (!Expect(line, pos, '}')) {
+            do {
+                auto name = ParseJsonString(line, pos, name_scratch_);
+                if (!name) return std::unexpected(name.error());
+                if (!Expect(line, pos, ':')) return std::unexpected("expected ':' after object key");
+
+                auto& scratch = *name == "key" ? key_scratch_ : *name == "value" ? value_scratch_ : other_scratch_;
+                SkipSpace(line, pos);
+                auto field = pos < line.size() && line[pos] == '"' ? ParseJsonString(line, pos, scratch)
+                                                                      : SkipJsonValue(line, pos);
+                if (!field) return std::unexpected(field.error());
+
+                if (*name == "key") {
+                    key = *field;
+                } else if (*name == "value") {
+                    value = *field;
+                }
+            } while (Expect(line, pos, ','));
+            if (!Expect(line, pos, '}')) return std::unexpected("expected ',' or '}' in object");
+        }
+
+        if (!key || !value) return std::unexpected("object requires \"key\" and \"value\" members");
+        return Record{*key, *value};
+    }
+
+    static constexpr void SkipSpace(std::string_view line, size_t& pos) {
+        while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t')) pos++;
+    }
+
+    static constexpr auto Expect(std::string_view line, size_t& pos, char c) -> bool {
+        SkipSpace(line, pos);
+        if (pos == line.size() || line[pos] != c) return false;
+        pos++;
+        return true;
+    }
+
+    static constexpr auto ParseJsonString(std::string_view line, size_t& pos, std::string& scratch)
+        -> std::expected<std::string_view, std::string_view> {
+        if (!Expect(line, pos, '"')) return std::unexpected("expected a json string");
+
+        const size_t start = pos;
+        while (pos < line.size() && line[pos] != '"' && line[pos] != '\\') pos++;
+        if (pos == line.size()) return std::unexpected("unterminated json string");
+        if (line[pos] == '"') return line.substr(start, pos++ - start);
+
+        scratch.assign(line.substr(start, pos - start));
+        while (pos < line.size()) {
+            const char c = line[pos++];
+            if (c == '"') return scratch;
+            if (c != '\\') {
+                scratch.push_back(c);
+                continue;
+            }
+            if (pos == line.size()) break;
+            switch (const char e = line[pos++]) {
+                case '"':
+                case '\\':
+                case '/':
+                    scratch.push_back(e);
+                    break;
+                case 'b':
+                    scratch.push_back('\b');
+                    break;
+                case 'f':
+                    scratch.push_back('\f');
+                    break;
+                case 'n':
+                    scratch.push_back('\n');
+                    break;
+                case 'r':
+                    scratch.push_back('\r');
+                    break;
+                case 't':
+                    scratch.push_back('\t');
+                    break;
+                case 'u': {
+                    auto code = ParseHex4(line, pos);
+                    if (!code) return std::unexpected("invalid \\u escape");
+                    uint32_t cp = *code;
+                    if (cp >= 0xD800 && cp < 0xDC00) {
+                        // Surrogate pair, the low half must follow as another \u escape
+                        if (line.substr(pos, 2) != "\\u") return std::unexpected("unpaired surrogate");
+                        pos += 2;
+                        auto low = ParseHex4(line, pos);
+                        if (!low || *low < 0xDC00 || *low >= 0xE000) return std::unexpected("invalid surrogate");
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (*low - 0xDC00);
+                    }
+                    AppendUtf8(scratch, cp);
+                    break;
+                }
+                default:
+                    return std::unexpected("unknown escape in json string");
+            }
+        }
+        return std::unexpected("unterminated json string");
+    }
+
+    // Returns the raw text of a number, literal, object or array
+    static constexpr auto SkipJsonValue(std::string_view line, size_t& pos)
+        -> std::expected<std::string_view, std::string_view> {
+        const size_t start = pos;
+        size_t depth = 0;
+        bool in_string = false;
+        for (; pos < line.size(); pos++) {
+            const char c = line[pos];
+            if (in_string) {
+                if (c == '\\') {
+                    pos++;
+                } else if (c == '"') {
+                    in_string = false;
+                }
+                continue;
+            }
+            if (c == '"') {
+                in_string = true;
+            } else if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (depth == 0) break;
+                if (--depth == 0) {
+                    pos++;
+                    break;
+                }
+            } else if (depth == 0 && (c == ',' || c == ' ' || c == '\t')) {
+                break;
+            }
+        }
+        if (depth != 0 || in_string || pos == start) return std::unexpected("invalid json value");
+        return line.substr(start, pos - start);
     }
+
+    RecordFormat format_;
+    std::string key_scratch_;
+    std::string value_scratch_;
+    std::string name_scratch_;
+    std::string other_scratch_;
 };
 
-struct ReadFunctor {
-    void operator()(const ArgsVector& args) const {
-        auto key = args[0];
-        leveldb::ReadOptions opts{};
-        std::string value;
-        const auto status = database->Get(opts, ViewToSlice(key), &value);
-        if (!status.ok()) {
-            println("error: read {} status='{}'", key, status.ToString());
-            return;
+constexpr auto ParsesInto(RecordFormat format, std::string_view line, std::string_view key, std::string_view value)
+    -> bool {
+    RecordParser parser(format);
+    const auto record = parser.Parse(line);
+    return record && record->key == key && record->value == value;
+}
+
+static_assert(ParsesInto(RecordFormat::csv, "k,v", "k", "v"));
+static_assert(ParsesInto(RecordFormat::csv, R"("a,b","say ""hi""")", "a,b", R"(say "hi")"));
+static_assert(ParsesInto(RecordFormat::csv, R"(k,"")", "k", ""));
+static_assert(ParsesInto(RecordFormat::csv, "\"two\nlines\",v", "two\nlines", "v"));
+static_assert(!RecordParser(RecordFormat::csv).Parse(R"("open,v)"));
+static_assert(!RecordParser(RecordFormat::csv).Parse("k,v,extra"));
+static_assert(ParsesInto(RecordFormat::tsv, "k\\tx\tv\\\\", "k\tx", "v\\"));
+static_assert(!RecordParser(RecordFormat::tsv).Parse("k\tv\\"));
+static_assert(ParsesInto(RecordFormat::ndjson, R"({"key": "a\"b\u00e9", "value": "\ud83d\ude00\n"})",
+                         "a\"b\xc3\xa9", "\xf0\x9f\x98\x80\n"));
+static_assert(ParsesInto(RecordFormat::ndjson, R"({"value": [1, {"x": "}"}], "id": 7, "key": "k"})",
+                         "k", R"([1, {"x": "}"}])"));
+static_assert(!RecordParser(RecordFormat::ndjson).Parse(R"({"key": "k", "value": "\ud83d"})"));
+static_assert(!RecordParser(RecordFormat::ndjson).Parse(R"({"key": "k"})"));
+
+// Collects output in one large buffer that is reused for all records and written out in big chunks
+class OutputBuffer {
+public:
+    static constexpr size_t kCapacity = 1 << 20;
+
+    explicit OutputBuffer(std::FILE* file)
+        : file_(file),
+          data_(std::make_unique<char[]>(kCapacity)) {}
+    OutputBuffer(const OutputBuffer&) = delete;
+    auto operator=(const OutputBuffer&) -> OutputBuffer& = delete;
+    ~OutputBuffer() { Flush(); }
+
+    void Append(std::string_view data) {
+        if (data.size() > kCapacity - size_) {
+            Flush();
+            if (data.size() > kCapacity) {
+                Write(data.data(), data.size());
+                return;
+            }
+        }
+        std::memcpy(data_.get() + size_, data.data(), data.size());
+        size_ += data.size();
+    }
+
+    void Append(char c) {
+        if (size_ == kCapacity) Flush();
+        data_[size_++] = c;
+    }
+
+    void Append(uint64_t number) {
+        char digits[20];
+        const auto [end, ec] = std::to_chars(std::begin(digits), std::end(digits), number);
+        Append(std::string_view(digits, end - digits));
+    }
+
+    auto Flush() -> bool {
+        if (size_ != 0) {
+            Write(data_.get(), size_);
+            size_ = 0;
         }
-        println("{}", value);
+        return !failed_;
     }
+
+    auto failed() const -> bool { return failed_; }
+    auto bytes_written() const -> uint64_t { return bytes_written_ + size_; }
+
+private:
+    void Write(const char* data, size_t size) {
+        if (std::fwrite(data, 1, size, file_) != size) failed_ = true;
+        bytes_written_ += size;
+    }
+
+    std::FILE* file_;
+    std::unique_ptr<char[]> data_;
+    size_t size_ = 0;
+    uint64_t bytes_written_ = 0;
+    bool failed_ = false;
 };
 
-struct RemoveFunctor {
-    void operator()(const ArgsVector& args) const {
-        auto key = args[0];
-        leveldb::WriteOptions opts{};
-        opts.sync = true;
+// Appends field, replacing every byte for which escape returns a sequence. Unescaped runs are copied in one piece.
+template <typename Out, typename F>
+constexpr void AppendEscaped(Out& out, std::string_view field, F escape) {
+    size_t run = 0;
+    for (size_t i = 0; i < field.size(); i++) {
+        const std::string_view replacement = escape(field[i]);
+        if (replacement.empty()) continue;
+        out.Append(field.substr(run, i - run));
+        out.Append(replacement);
+        run = i + 1;
+    }
+    out.Append(field.substr(run));
+}
 
-        const auto status = database->Delete(opts, ViewToSlice(key));
-        if (!status.ok()) {
-            println("error: remove {} status='{}'", key, status.ToString());
-            return;
+void AppendCsvField(OutputBuffer& out, std::string_view field) {
+    if (field.find_first_of(",\"\r\n") == std::string_view::npos) {
+        out.Append(field);
+        return;
+    }
+    out.Append('"');
+    AppendEscaped(out, field, [](char c) { return c == '"' ? std::string_view("\"\"") : std::string_view(); });
+    out.Append('"');
+}
+
+void AppendTsvField(OutputBuffer& out, std::string_view field) {
+    AppendEscaped(out, field, [](char c) {
+        switch (c) {
+            case '\t':
+                return std::string_view("\\t");
+            case '\n':
+                return std::string_view("\\n");
+            case '\r':
+                return std::string_view("\\r");
+            case '\\':
+                return std::string_view("\\\\");
+            default:
+                return std::string_view();
         }
-        println("OK");
+    });
+}
+
+// Escape sequence of every byte in a JSON string, the last element holds its length and 0 means no escape
+constexpr auto kJsonEscapes = [] {
+    std::array<std::array<char, 7>, 256> table{};
+    for (size_t c = 0; c < 0x20; c++) {
+        table[c] = {'\\', 'u', '0', '0', kHexDigits[c >> 4], kHexDigits[c & 0xF], 6};
+    }
+    table['\n'] = {'\\', 'n', 0, 0, 0, 0, 2};
+    table['\r'] = {'\\', 'r', 0, 0, 0, 0, 2};
+    table['\t'] = {'\\', 't', 0, 0, 0, 0, 2};
+    table['"'] = {'\\', '"', 0, 0, 0, 0, 2};
+    table['\\'] = {'\\', '\\', 0, 0, 0, 0, 2};
+    return table;
+}();
+
+// Bytes outside ASCII are passed through unchanged, so binary data round-trips through import but may not be UTF-8
+template <typename Out>
+constexpr void AppendJsonString(Out& out, std::string_view field) {
+    out.Append('"');
+    AppendEscaped(out, field, [](char c) {
+        const auto& escape = kJsonEscapes[static_cast<uint8_t>(c)];
+        return std::string_view(escape.data(), static_cast<size_t>(escape[6]));
+    });
+    out.Append('"');
+}
+
+void AppendRecord(OutputBuffer& out, RecordFormat format, std::string_view key, std::string_view value) {
+    switch (format) {
+        case RecordFormat::text:
+            out.Append(key);
+            out.Append(": ");
+            out.Append(value);
+            break;
+        case RecordFormat::csv:
+            AppendCsvField(out, key);
+            out.Append(',');
+            AppendCsvField(out, value);
+            break;
+        case RecordFormat::tsv:
+            AppendTsvField(out, key);
+            out.Append('\t');
+            AppendTsvField(out, value);
+            break;
+        case RecordFormat::ndjson:
+            out.Append("{\"key\":");
+            AppendJsonString(out, key);
+            out.Append(",\"value\":");
+            AppendJsonString(out, value);
+            out.Append('}');
+            break;
     }
+    out.Append('\n');
+}
+
+// Collects text with the OutputBuffer interface into a string, for output that may still be replaced
+struct StringOutput {
+    std::string& text;
+
+    constexpr void Append(std::string_view data) { text.append(data); }
+    constexpr void Append(char c) { text.push_back(c); }
 };
 
-template <typename F>
-constexpr auto WrapNoArgs() {
-    return +[](const ArgsVector&) { F()(); };
+// Element types of the tuple codec. Integers are fixed width big-endian so keys sort by value, signed ones with the
+// sign bit flipped. str and bytes (hex) take the rest of the key and can only come last.
+enum class TupleElement : uint8_t { u8, u16, u32, u64, i8, i16, i32, i64, str, bytes };
+
+struct CodecSpec {
+    Codec codec = Codec::raw;
+    std::vector<TupleElement> schema = {};  // tuple only
+};
+
+// Session codecs, set keycodec / valcodec. Keys and values are stored encoded and shown decoded.
+CodecSpec key_codec;
+CodecSpec value_codec;
+
+constexpr void AppendHex(std::string& out, std::string_view bytes) {
+    for (const char c : bytes) {
+        out.push_back(kHexDigits[static_cast<uint8_t>(c) >> 4]);
+        out.push_back(kHexDigits[static_cast<uint8_t>(c) & 0xf]);
+    }
 }
 
-template <typename F>
-constexpr auto Wrap() {
-    return +[](const ArgsVector& args) { F()(args); };
+constexpr void AppendBigEndian(std::string& out, uint64_t value, size_t width) {
+    for (size_t i = width; i-- > 0;) out.push_back(static_cast<char>(value >> (i * 8)));
 }
 
-constexpr auto ViewToSlice(std::string_view view) -> leveldb::Slice { return {view.data(), view.size()}; }
+constexpr auto ReadBigEndian(std::string_view& in, size_t width, uint64_t& value) -> bool {
+    if (in.size() < width) return false;
+    value = 0;
+    for (size_t i = 0; i < width; i++) value = (value << 8) | static_cast<uint8_t>(in[i]);
+    in.remove_prefix(width);
+    return true;
+}
 
-constexpr auto GetInfo(Instruction inst) -> const InstructionInfo& {
-    using KeyValue = std::pair<Instruction, InstructionInfo>;
-    static constexpr std::array<KeyValue, 8> infos{
-        {{Instruction::help, InstructionInfo("Print this help message", {}, WrapNoArgs<PrintHelpFunctor>())},
-         {Instruction::exit, InstructionInfo("Exit the repl", {}, WrapNoArgs<ExitFunctor>())},
-         {Instruction::close, InstructionInfo("Close database", {}, WrapNoArgs<CloseFunctor>(), true)},
-         {Instruction::open, InstructionInfo("Open database", {.data = "path", .size = 1}, Wrap<OpenFunctor>())},
-         {Instruction::read,
-          InstructionInfo("Read value from db", {.data = "key", .size = 1}, Wrap<ReadFunctor>(), true)},
-         {Instruction::write,
-          InstructionInfo("Write value to db", {.data = "key value", .size = 2}, Wrap<WriteFunctor>(), true)},
-         {Instruction::dump, InstructionInfo("Print all items in db", {}, WrapNoArgs<DumpFunctor>(), true)},
-         {Instruction::remove,
-          InstructionInfo("Remove an item from db", {.data = "key", .size = 1}, Wrap<RemoveFunctor>(), true)}}};
-    return std::ranges::find(infos, inst, &KeyValue::first)->second;
+constexpr auto ReadVarint(std::string_view& in, uint64_t& value) -> bool {
+    value = 0;
+    for (size_t i = 0; i < 10 && i < in.size(); i++) {
+        const auto byte = static_cast<uint8_t>(in[i]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if ((byte & 0x80) == 0) {
+            in.remove_prefix(i + 1);
+            return true;
+        }
+    }
+    return false;
 }
 
-void PrintInvalidStateError(Instruction inst, std::string_view requirement) {
-    println("error: {} requires {}", enchantum::to_string(inst), requirement);
+template <typename T>
+constexpr void AppendNumber(std::string& out, T value) {
+    if constexpr (std::is_integral_v<T>) {
+        char digits[20];
+        const auto [end, ec] = std::to_chars(std::begin(digits), std::end(digits), value);
+        out.append(digits, end - digits);
+    } else {
+        std::format_to(std::back_inserter(out), "{}", value);
+    }
 }
 
-void PrintSizeMismatchError(Instruction inst, size_t expected, size_t actual) {
-    println("error: {} expected {} arguments got {}", enchantum::to_string(inst), expected, actual);
+using CodecResult = std::expected<void, std::string>;
+
+constexpr auto EncodeRaw(const CodecSpec&, std::string_view text, std::string& out) -> CodecResult {
+    out.append(text);
+    return {};
 }
 
-void PrintSyntaxError(std::string_view input, size_t pos, std::string_view error_msg) {
-    size_t length = pos + 1;
-    println("error: {}\n{}\n{:>{}}{:~^{}}", error_msg, input, '^', length, "", input.size() - length);
+constexpr auto DecodeRaw(const CodecSpec&, std::string_view bytes, std::string& out) -> bool {
+    out.append(bytes);
+    return true;
+}
+
+constexpr auto EncodeHex(const CodecSpec&, std::string_view text, std::string& out) -> CodecResult {
+    if (text.starts_with("0x")) text.remove_prefix(2);
+    if (text.size() % 2 != 0) return std::unexpected(std::format("hex '{}' has an odd number of digits", text));
+    for (size_t i = 0; i < text.size(); i += 2) {
+        uint8_t byte = 0;
+        const auto [ptr, ec] = std::from_chars(text.data() + i, text.data() + i + 2, byte, 16);
+        if (ec != std::errc() || ptr != text.data() + i + 2) {
+            return std::unexpected(std::format("hex '{}' is not a hex digit pair", text.substr(i, 2)));
+        }
+        out.push_back(static_cast<char>(byte));
+    }
+    return {};
+}
+
+constexpr auto DecodeHex(const CodecSpec&, std::string_view bytes, std::string& out) -> bool {
+    AppendHex(out, bytes);
+    return true;
 }
 
-auto SliceInput(std::string_view input, size_t start, size_t end, bool erease_quotes) {
-    auto length = end - start;
-    if (erease_quotes) {
-        start++;
-        length -= 2;
+constexpr auto TupleWidth(TupleElement element) -> size_t {
+    switch (element) {
+        case TupleElement::u8:
+        case TupleElement::i8:
+            return 1;
+        case TupleElement::u16:
+        case TupleElement::i16:
+            return 2;
+        case TupleElement::u32:
+        case TupleElement::i32:
+            return 4;
+        case TupleElement::u64:
+        case TupleElement::i64:
+            return 8;
+        case TupleElement::str:
+        case TupleElement::bytes:
+            return 0;
     }
-    return input.substr(start, length);
+    return 0;
 }
 
-auto ParseInput(std::string_view input) -> std::optional<ArgsVector> {
-    ArgsVector result;
-    size_t pos{};
-    struct Flags {
-        bool skipping : 1;
-        bool erease_quotes : 1;
-    } flags{};
+constexpr auto TupleSigned(TupleElement element) -> bool {
+    return element == TupleElement::i8 || element == TupleElement::i16 || element == TupleElement::i32 ||
+           element == TupleElement::i64;
+}
 
-    char current;
-    size_t quote_start;
+// Elements are separated by ':', fewer elements than the schema encode a prefix for scans
+constexpr auto EncodeTuple(const CodecSpec& spec, std::string_view text, std::string& out) -> CodecResult {
+    if (text.empty()) return {};
+    for (const auto element : spec.schema) {
+        const auto width = TupleWidth(element);
+        const auto colon = width == 0 ? std::string_view::npos : text.find(':');
+        const auto part = text.substr(0, colon);
+        text.remove_prefix(colon == std::string_view::npos ? text.size() : colon + 1);
 
-    for (size_t i = 0; i < input.size(); i++) {
-        // Catch single and double quotes
-        if (input[i] == 0x22 || input[i] == 0x27) {
-            if (flags.skipping) {
-                // Don't end skipping we allow double quotes in single quotes and vice versa
-                if (current != input[i]) continue;
-                flags.erease_quotes = true;
+        if (element == TupleElement::str) {
+            out.append(part);
+        } else if (element == TupleElement::bytes) {
+            if (auto hex = EncodeHex(spec, part, out); !hex) return hex;
+        } else {
+            // Signed values are offset by 2^(bits - 1), which flips the sign bit of the two's complement
+            const auto bits = width * 8;
+            const uint64_t max = bits == 64 ? UINT64_MAX : (uint64_t{1} << bits) - 1;
+            uint64_t value = 0;
+            std::from_chars_result result{};
+            if (TupleSigned(element)) {
+                int64_t number = 0;
+                result = std::from_chars(part.data(), part.data() + part.size(), number);
+                const int64_t low = bits == 64 ? INT64_MIN : -(int64_t{1} << (bits - 1));
+                if (number < low || number > static_cast<int64_t>(max >> 1)) result.ec = std::errc::result_out_of_range;
+                value = (static_cast<uint64_t>(number) ^ (uint64_t{1} << (bits - 1))) & max;
             } else {
-                quote_start = i;
-                current = input[i];
+                result = std::from_chars(part.data(), part.data() + part.size(), value);
+                if (value > max) result.ec = std::errc::result_out_of_range;
+            }
+            if (result.ec != std::errc() || result.ptr != part.data() + part.size()) {
+                return std::unexpected(
+                    std::format("tuple element '{}' is not a {}", part, enchantum::to_string(element)));
             }
+            AppendBigEndian(out, value, width);
+        }
+        if (colon == std::string_view::npos) return {};
+    }
+    return std::unexpected(std::format("tuple has only {} elements, '{}' is left over", spec.schema.size(), text));
+}
 
-            flags.skipping = !flags.skipping;
-            continue;
+// A key ending at an element boundary decodes as a shorter tuple
+constexpr auto DecodeTuple(const CodecSpec& spec, std::string_view bytes, std::string& out) -> bool {
+    for (size_t i = 0; i < spec.schema.size() && !bytes.empty(); i++) {
+        const auto element = spec.schema[i];
+        if (i != 0) out.push_back(':');
+        if (element == TupleElement::str) {
+            out.append(bytes);
+            return true;
+        }
+        if (element == TupleElement::bytes) {
+            AppendHex(out, bytes);
+            return true;
         }
 
-        // Skip if we are skipping or not a space
-        if (input[i] != 0x20 || flags.skipping) {
+        const auto width = TupleWidth(element);
+        uint64_t value = 0;
+        if (!ReadBigEndian(bytes, width, value)) return false;
+        if (!TupleSigned(element)) {
+            AppendNumber(out, value);
             continue;
         }
-
-        result.push_back(SliceInput(input, pos, i, flags.erease_quotes));
-        pos = i + 1;
-        flags.erease_quotes = false;
+        // Undo the sign flip and sign extend from the element width
+        const auto bits = width * 8;
+        value ^= uint64_t{1} << (bits - 1);
+        const auto shift = 64 - bits;
+        AppendNumber(out, static_cast<int64_t>(value << shift) >> shift);
     }
+    return bytes.empty();
+}
 
-    if (flags.skipping) {
-        PrintSyntaxError(input, quote_start, "Expected quotes or double quotes to be closed");
-        return std::nullopt;
+// LEB128 varints separated by ':'
+constexpr auto EncodeVarint(const CodecSpec&, std::string_view text, std::string& out) -> CodecResult {
+    while (!text.empty()) {
+        const auto colon = text.find(':');
+        const auto part = text.substr(0, colon);
+        text.remove_prefix(colon == std::string_view::npos ? text.size() : colon + 1);
+
+        uint64_t value = 0;
+        const auto [ptr, ec] = std::from_chars(part.data(), part.data() + part.size(), value);
+        if (ec != std::errc() || ptr != part.data() + part.size()) {
+            return std::unexpected(std::format("varint '{}' is not a number", part));
+        }
+        for (; value >= 0x80; value >>= 7) out.push_back(static_cast<char>(value | 0x80));
+        out.push_back(static_cast<char>(value));
     }
+    return {};
+}
 
-    result.push_back(SliceInput(input, pos, input.size(), flags.erease_quotes));
-    return result;
+constexpr auto DecodeVarint(const CodecSpec&, std::string_view bytes, std::string& out) -> bool {
+    for (bool first = true; !bytes.empty(); first = false) {
+        uint64_t value = 0;
+        if (!ReadVarint(bytes, value)) return false;
+        if (!first) out.push_back(':');
+        AppendNumber(out, value);
+    }
+    return true;
 }
 
-auto main() -> int {
-    signal(SIGINT, [](int) {
-        println("\nUser Interrupt");
-        ExitFunctor()();
-    });
+// Writes one msgpack value as JSON text. bin and ext payloads become hex strings, map keys may be any value.
+class MsgpackDecoder {
+public:
+    constexpr explicit MsgpackDecoder(std::string_view in)
+        : in_(in) {}
 
-    std::string user_input{};
-    user_input.reserve(32);
+    constexpr auto Decode(std::string& out) -> bool { return Value(out, 0) && in_.empty(); }
 
-    println("LevelDB R.E.P.L.");
-    println("Type 'help' for more information.");
-    for (;;) {
-        user_input.clear();
-        print(">>> ");
-        std::getline(std::cin, user_input);
-        if (user_input.empty()) {
-            continue;
+private:
+    static constexpr int kMaxDepth = 64;
+
+    constexpr auto Length(size_t width, uint64_t& length) -> bool { return ReadBigEndian(in_, width, length); }
+
+    constexpr auto Take(uint64_t size, std::string_view& bytes) -> bool {
+        if (size > in_.size()) return false;
+        bytes = in_.substr(0, size);
+        in_.remove_prefix(size);
+        return true;
+    }
+
+    constexpr auto String(std::string& out, uint64_t size) -> bool {
+        std::string_view bytes;
+        if (!Take(size, bytes)) return false;
+        StringOutput text{out};
+        AppendJsonString(text, bytes);
+        return true;
+    }
+
+    constexpr auto Bin(std::string& out, uint64_t size) -> bool {
+        std::string_view bytes;
+        if (!Take(size, bytes)) return false;
+        out.append("\"0x");
+        AppendHex(out, bytes);
+        out.push_back('"');
+        return true;
+    }
+
+    constexpr auto Ext(std::string& out, uint64_t size) -> bool {
+        std::string_view type;
+        if (!Take(1, type)) return false;
+        out.append("{\"ext\":");
+        AppendNumber(out, static_cast<int8_t>(type[0]));
+        out.append(",\"data\":");
+        return Bin(out, size) && (out.push_back('}'), true);
+    }
+
+    // Every element takes at least one byte, larger counts are corrupt and rejected before looping over them
+    constexpr auto Array(std::string& out, uint64_t count, int depth) -> bool {
+        if (count > in_.size()) return false;
+        out.push_back('[');
+        for (uint64_t i = 0; i < count; i++) {
+            if (i != 0) out.push_back(',');
+            if (!Value(out, depth + 1)) return false;
         }
+        out.push_back(']');
+        return true;
+    }
+
+    constexpr auto Map(std::string& out, uint64_t count, int depth) -> bool {
+        if (count > in_.size() / 2) return false;
+        out.push_back('{');
+        for (uint64_t i = 0; i < count; i++) {
+            if (i != 0) out.push_back(',');
+            if (!Value(out, depth + 1)) return false;
+            out.push_back(':');
+            if (!Value(out, depth + 1)) return false;
+        }
+        out.push_back('}');
+        return true;
+    }
 
-        auto parsed = ParseInput(user_input);
-        if (!parsed) continue;
+    template <typename T>
+    constexpr auto Number(std::string& out, size_t width) -> bool {
+        uint64_t bits = 0;
+        if (!ReadBigEndian(in_, width, bits)) return false;
+        if constexpr (std::is_same_v<T, float>) {
+            AppendNumber(out, std::bit_cast<float>(static_cast<uint32_t>(bits)));
+        } else if constexpr (std::is_same_v<T, double>) {
+            AppendNumber(out, std::bit_cast<double>(bits));
+        } else {
+            AppendNumber(out, static_cast<T>(bits));
+        }
+        return true;
+    }
 
-        auto& args = parsed.value();
-        if (args.empty()) continue;
+    constexpr auto Value(std::string& out, int depth) -> bool {
+        if (in_.empty() || depth > kMaxDepth) return false;
+        const auto tag = static_cast<uint8_t>(in_[0]);
+        in_.remove_prefix(1);
 
-        const auto instruction = enchantum::cast<Instruction>(args[0]);
-        if (!instruction) {
-            println("Unknown instruction '{}' !", args[0]);
-            continue;
+        uint64_t length = 0;
+        if (tag <= 0x7f) return AppendNumber(out, tag), true;
+        if (tag >= 0xe0) return AppendNumber(out, static_cast<int8_t>(tag)), true;
+        if ((tag & 0xf0) == 0x80) return Map(out, tag & 0x0f, depth);
+        if ((tag & 0xf0) == 0x90) return Array(out, tag & 0x0f, depth);
+        if ((tag & 0xe0) == 0xa0) return String(out, tag & 0x1f);
+        switch (tag) {
+            case 0xc0:
+                out.append("null");
+                return true;
+            case 0xc2:
+                out.append("false");
+                return true;
+            case 0xc3:
+                out.append("true");
+                return true;
+            case 0xc4:
+            case 0xc5:
+            case 0xc6:
+                return Length(size_t{1} << (tag - 0xc4), length) && Bin(out, length);
+            case 0xc7:
+            case 0xc8:
+            case 0xc9:
+                return Length(size_t{1} << (tag - 0xc7), length) && Ext(out, length);
+            case 0xca:
+                return Number<float>(out, 4);
+            case 0xcb:
+                return Number<double>(out, 8);
+            case 0xcc:
+                return Number<uint8_t>(out, 1);
+            case 0xcd:
+                return Number<uint16_t>(out, 2);
+            case 0xce:
+                return Number<uint32_t>(out, 4);
+            case 0xcf:
+                return Number<uint64_t>(out, 8);
+            case 0xd0:
+                return Number<int8_t>(out, 1);
+            case 0xd1:
+                return Number<int16_t>(out, 2);
+            case 0xd2:
+                return Number<int32_t>(out, 4);
+            case 0xd3:
+                return Number<int64_t>(out, 8);
+            case 0xd4:
+            case 0xd5:
+            case 0xd6:
+            case 0xd7:
+            case 0xd8:
+                return Ext(out, uint64_t{1} << (tag - 0xd4));
+            case 0xd9:
+            case 0xda:
+            case 0xdb:
+                return Length(size_t{1} << (tag - 0xd9), length) && String(out, length);
+            case 0xdc:
+            case 0xdd:
+                return Length(tag == 0xdc ? 2 : 4, length) && Array(out, length, depth);
+            case 0xde:
+            case 0xdf:
+                return Length(tag == 0xde ? 2 : 4, length) && Map(out, length, depth);
+            default:
+                return false;
         }
-        args.erase(args.begin());  // Remove instruction from args
+    }
 
-        auto& info = GetInfo(*instruction);
-        if (info.require_db && database == nullptr) {
-            PrintInvalidStateError(*instruction, "Opened Database");
-            continue;
+    std::string_view in_;
+};
+
+// Parses JSON text and writes it as msgpack. Integers take the smallest encoding, other numbers are float64.
+class MsgpackEncoder {
+public:
+    constexpr explicit MsgpackEncoder(std::string_view in)
+        : in_(in) {}
+
+    constexpr auto Encode(std::string& out) -> CodecResult {
+        if (!Value(out, 0) || (SkipSpace(), pos_ != in_.size())) {
+            return std::unexpected(std::format("msgpack invalid json at offset {}", pos_));
         }
+        return {};
+    }
 
-        if (!info.args.data.empty() && args.size() != info.args.size) {
-            PrintSizeMismatchError(*instruction, info.args.size, args.size());
-            continue;
+private:
+    static constexpr int kMaxDepth = 64;
+
+    constexpr void SkipSpace() {
+        while (pos_ < in_.size() && (in_[pos_] == ' ' || in_[pos_] == '\t' || in_[pos_] == '\n' || in_[pos_] == '\r')) {
+            pos_++;
         }
+    }
 
-        info.impl(args);
+    constexpr auto Consume(char c) -> bool {
+        SkipSpace();
+        if (pos_ == in_.size() || in_[pos_] != c) return false;
+        pos_++;
+        return true;
     }
-    return 0;
-}
\ No newline at end of file
+
+    constexpr auto Literal(std::string_view word) -> bool {
+        if (!in_.substr(pos_).starts_with(word)) return false;
+        pos_ += word.size();
+        return true;
+    }
+
+    static constexpr void Header(std::string& out, uint64_t size, uint8_t fix, size_t fix_limit, uint8_t tag16) {
+        if (size < fix_limit) {
+            out.push_back(static_cast<char>(fix | size));
+        } else if (size <= UINT16_MAX) {
+            out.push_back(static_cast<char>(tag16));
+            AppendBigEndian(out, size, 2);
+        } else {
+            out.push_back(static_cast<char>(tag16 + 1));
+            AppendBigEndian(out, size, 4);
+        }
+    }
+
+    static constexpr void Integer(std::string& out, int64_t value) {
+        if (value >= 0 && value <= 0x7f) {
+            out.push_back(static_cast<char>(value));
+        } else if (value < 0 && value >= -32) {
+            out.push_back(static_cast<char>(value));
+        } else if (value >= 0) {
+            const auto width = value <= UINT8_MAX ? 1 : value <= UINT16_MAX ? 2 : value <= UINT32_MAX ? 4 : 8;
+            out.push_back(static_cast<char>(0xcc + std::countr_zero(static_cast<unsigned>(width))));
+            AppendBigEndian(out, static_cast<uint64_t>(value), width);
+        } else {
+            const auto width = value >= INT8_MIN ? 1 : value >= INT16_MIN ? 2 : value >= INT32_MIN ? 4 : 8;
+            out.push_back(static_cast<char>(0xd0 + std::countr_zero(static_cast<unsigned>(width))));
+            AppendBigEndian(out, static_cast<uint64_t>(value), width);
+        }
+    }
+
+    constexpr auto Number(std::string& out) -> bool {
+        const auto start = pos_;
+        bool integral = true;
+        for (; pos_ < in_.size() && std::string_view("+-0123456789.eE").contains(in_[pos_]); pos_++) {
+            if (in_[pos_] == '.' || in_[pos_] == 'e' || in_[pos_] == 'E') integral = false;
+        }
+        const char* first = in_.data() + start;
+        const char* last = in_.data() + pos_;
+        if (integral) {
+            int64_t value = 0;
+            if (auto [ptr, ec] = std::from_chars(first, last, value); ec == std::errc() && ptr == last) {
+                Integer(out, value);
+                return true;
+            }
+            uint64_t large = 0;
+            if (auto [ptr, ec] = std::from_chars(first, last, large); ec == std::errc() && ptr == last) {
+                out.push_back(static_cast<char>(0xcf));
+                AppendBigEndian(out, large, 8);
+                return true;
+            }
+        }
+        // Floating point from_chars is not constexpr, constant evaluation only covers integers
+        if consteval {
+            return false;
+        } else {
+            double value = 0;
+            const auto [ptr, ec] = std::from_chars(first, last, value);
+            if (ec != std::errc() || ptr != last) return false;
+            out.push_back(static_cast<char>(0xcb));
+            AppendBigEndian(out, std::bit_cast<uint64_t>(value), 8);
+            return true;
+        }
+    }
+
+    // Expects pos_ after the opening quote
+    constexpr auto String(std::string& text) -> bool {
+        while (pos_ < in_.size()) {
+            const char c = in_[pos_++];
+            if (c == '"') return true;
+            if (c != '\\') {
+                text.push_back(c);
+                continue;
+            }
+            if (pos_ == in_.size()) return false;
+            switch (const char escape = in_[pos_++]) {
+                case 'b':
+                    text.push_back('\b');
+                    break;
+                case 'f':
+                    text.push_back('\f');
+                    break;
+                case 'n':
+                    text.push_back('\n');
+                    break;
+                case 'r':
+                    text.push_back('\r');
+                    break;
+                case 't':
+                    text.push_back('\t');
+                    break;
+                case 'u': {
+                    auto code = ParseHex4(in_, pos_);
+                    if (!code) return false;
+                    // A high surrogate combines with the \u escape following it
+                    if (*code >= 0xd800 && *code < 0xdc00 && Literal("\\u")) {
+                        const auto low = ParseHex4(in_, pos_);
+                        if (low && *low >= 0xdc00 && *low < 0xe000) {
+                            *code = 0x10000 + ((*code - 0xd800) << 10) + (*low - 0xdc00);
+                        }
+                    }
+                    AppendUtf8(text, *code);
+                    break;
+                }
+                default:
+                    text.push_back(escape);
+                    break;
+            }
+        }
+        return false;
+    }
+
+    // Element counts come first in msgpack, so the elements are encoded into a scratch buffer and appended after
+    constexpr auto Container(std::string& out, char close, int depth, uint8_t fix, uint8_t tag16) -> bool {
+        std::string elements;
+        uint64_t count = 0;
+        if (!Consume(close)) {
+            do {
+                if (close == '}') {
+                    SkipSpace();
+                    if (!Value(elements, depth + 1) || !Consume(':')) return false;
+                }
+                if (!Value(elements, depth + 1)) return false;
+                count++;
+            } while (Consume(','));
+            if (!Consume(close)) return false;
+        }
+        Header(out, count, fix, fix == 0x80 || fix == 0x90 ? 16 : 32, tag16);
+        out.append(elements);
+        return true;
+    }
+
+    constexpr auto Value(std::string& out, int depth) -> bool {
+        SkipSpace();
+        if (pos_ == in_.size() || depth > kMaxDepth) return false;
+        switch (in_[pos_]) {
+            case '{':
+                pos_++;
+                return Container(out, '}', depth, 0x80, 0xde);
+            case '[':
+                pos_++;
+                return Container(out, ']', depth, 0x90, 0xdc);
+            case '"': {
+                pos_++;
+                std::string text;
+                if (!String(text)) return false;
+                if (text.size() < 32) {
+                    out.push_back(static_cast<char>(0xa0 | text.size()));
+                } else if (text.size() <= UINT8_MAX) {
+                    out.push_back(static_cast<char>(0xd9));
+                    out.push_back(static_cast<char>(text.size()));
+                } else {
+                    Header(out, text.size(), 0, 0, 0xda);
+                }
+                out.append(text);
+                return true;
+            }
+            case 't':
+                return Literal("true") && (out.push_back(static_cast<char>(0xc3)), true);
+            case 'f':
+                return Literal("false") && (out.push_back(static_cast<char>(0xc2)), true);
+            case 'n':
+                return Literal("null") && (out.push_back(static_cast<char>(0xc0)), true);
+            default:
+                return Number(out);
+        }
+    }
+
+    std::string_view in_;
+    size_t pos_ = 0;
+};
+
+constexpr auto EncodeMsgpack(const CodecSpec&, std::string_view text, std::string& out) -> CodecResult {
+    return MsgpackEncoder(text).Encode(out);
+}
+
+constexpr auto DecodeMsgpack(const CodecSpec&, std::string_view bytes, std::string& out) -> bool {
+    return MsgpackDecoder(bytes).Decode(out);
+}
+
+// Schema-less like protoc --decode_raw, on one line: {1: 150, 2: "text", 3: {1: 5}}. Length delimited fields show
+// as a string when printable, else as a nested message when they parse as one, else as hex.
+auto DecodeProtobufMessage(std::string_view in, std::string& out, int depth) -> bool {
+    static constexpr int kMaxDepth = 32;
+    const auto printable = [](std::string_view bytes) {
+        return std::ranges::all_of(bytes, [](char c) {
+            return static_cast<uint8_t>(c) >= 0x20 || c == '\n' || c == '\t';
+        });
+    };
+
+    out.push_back('{');
+    for (bool first = true; !in.empty(); first = false) {
+        uint64_t tag = 0;
+        if (!ReadVarint(in, tag) || tag >> 3 == 0) return false;
+        if (!first) out.append(", ");
+        AppendNumber(out, tag >> 3);
+        out.append(": ");
+
+        uint64_t value = 0;
+        switch (tag & 7) {
+            case 0:
+                if (!ReadVarint(in, value)) return false;
+                AppendNumber(out, value);
+                break;
+            case 1:
+            case 5: {
+                const size_t width = (tag & 7) == 1 ? 8 : 4;
+                if (in.size() < width) return false;
+                for (size_t i = width; i-- > 0;) value = (value << 8) | static_cast<uint8_t>(in[i]);
+                in.remove_prefix(width);
+                AppendNumber(out, value);
+                break;
+            }
+            case 2: {
+                if (!ReadVarint(in, value) || value > in.size()) return false;
+                const auto payload = in.substr(0, value);
+                in.remove_prefix(value);
+                if (printable(payload)) {
+                    StringOutput text{out};
+                    AppendJsonString(text, payload);
+                    break;
+                }
+                const auto mark = out.size();
+                if (depth < kMaxDepth && DecodeProtobufMessage(payload, out, depth + 1)) break;
+                out.resize(mark);
+                out.append("0x");
+                AppendHex(out, payload);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    out.push_back('}');
+    return true;
+}
+
+auto DecodeProtobuf(const CodecSpec&, std::string_view bytes, std::string& out) -> bool {
+    return DecodeProtobufMessage(bytes, out, 0);
+}
+
+struct CodecInfo {
+    using EncodeFn = CodecResult (*)(const CodecSpec&, std::string_view, std::string&);
+    using DecodeFn = bool (*)(const CodecSpec&, std::string_view, std::string&);
+
+    std::string_view description;
+    EncodeFn encode;  // nullptr when the codec only decodes
+    DecodeFn decode;  // Returns false on bytes that are not in the codec's format
+};
+
+constexpr auto kCodecInfos = MakeDenseTable(std::to_array<std::pair<Codec, CodecInfo>>({
+    {Codec::raw, {"bytes as they are", EncodeRaw, DecodeRaw}},
+    {Codec::hex, {"hex digits", EncodeHex, DecodeHex}},
+    {Codec::tuple, {"big-endian tuple, schema like u32,i64,str", EncodeTuple, DecodeTuple}},
+    {Codec::varint, {"LEB128 varints separated by ':'", EncodeVarint, DecodeVarint}},
+    {Codec::msgpack, {"msgpack, written as json", EncodeMsgpack, DecodeMsgpack}},
+    {Codec::protobuf, {"protobuf without schema, decode only", nullptr, DecodeProtobuf}},
+}));
+
+// Encodes text to exactly bytes and decodes them back to text
+constexpr auto RoundTrips(const CodecSpec& spec, std::string_view text, std::string_view bytes) -> bool {
+    const auto& info = kCodecInfos[static_cast<size_t>(spec.codec)];
+    std::string encoded;
+    std::string decoded;
+    return info.encode(spec, text, encoded) && encoded == bytes && info.decode(spec, bytes, decoded) && decoded == text;
+}
+
+constexpr auto Undecodable(const CodecSpec& spec, std::string_view bytes) -> bool {
+    std::string decoded;
+    return !kCodecInfos[static_cast<size_t>(spec.codec)].decode(spec, bytes, decoded);
+}
+
+static_assert(RoundTrips({.codec = Codec::hex}, "00ff7f", std::string_view("\x00\xff\x7f", 3)));
+static_assert(RoundTrips({.codec = Codec::varint}, "0:127:128:300", std::string_view("\x00\x7f\x80\x01\xac\x02", 6)));
+static_assert(RoundTrips({.codec = Codec::varint},
+                         "18446744073709551615",
+                         "\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"));
+static_assert(Undecodable({.codec = Codec::varint}, "\x01\x80"));
+static_assert(RoundTrips({.codec = Codec::tuple, .schema = {TupleElement::u16, TupleElement::i32, TupleElement::str}},
+                         "7:-2:abc",
+                         std::string_view("\x00\x07\x7f\xff\xff\xfe" "abc", 9)));
+static_assert(RoundTrips({.codec = Codec::tuple, .schema = {TupleElement::i8, TupleElement::bytes}},
+                         "-128:00ff",
+                         std::string_view("\x00\x00\xff", 3)));
+static_assert(RoundTrips({.codec = Codec::tuple, .schema = {TupleElement::u16, TupleElement::u32}},
+                         "7",
+                         std::string_view("\x00\x07", 2)));
+static_assert(Undecodable({.codec = Codec::tuple, .schema = {TupleElement::u16, TupleElement::u32}},
+                          std::string_view("\x00\x07\x01", 3)));
+static_assert(RoundTrips({.codec = Codec::msgpack},
+                         R"({"a":[1,-1,300,-40000,"x\"\n",true,null],"b":{}})",
+                         "\x82\xa1" "a" "\x97\x01\xff\xcd\x01\x2c\xd2\xff\xff\x63\xc0"
+                         "\xa3" "x\"\n" "\xc3\xc0\xa1" "b" "\x80"));
+static_assert(RoundTrips({.codec = Codec::msgpack}, "18446744073709551615", "\xcf\xff\xff\xff\xff\xff\xff\xff\xff"));
+static_assert(Undecodable({.codec = Codec::msgpack}, "\x92\x01"));
+
+auto CodecName(const CodecSpec& spec) -> std::string {
+    std::string name(enchantum::to_string(spec.codec));
+    for (size_t i = 0; i < spec.schema.size(); i++) {
+        name.push_back(i == 0 ? '(' : ',');
+        name.append(enchantum::to_string(spec.schema[i]));
+    }
+    if (!spec.schema.empty()) name.push_back(')');
+    return name;
+}
+
+// Text typed by the user in the bytes the codec stores. Raw text is returned as is, the rest lands in scratch.
+auto EncodeArgument(const CodecSpec& spec, std::string_view text, std::string& scratch, std::string_view what)
+    -> std::optional<std::string_view> {
+    if (spec.codec == Codec::raw) return text;
+    const auto& info = kCodecInfos[static_cast<size_t>(spec.codec)];
+    if (info.encode == nullptr) {
+        PrintError("{} codec {} can only decode", what, CodecName(spec));
+        return std::nullopt;
+    }
+    scratch.clear();
+    if (auto result = info.encode(spec, text, scratch); !result) {
+        PrintError("{} {}", what, result.error());
+        return std::nullopt;
+    }
+    return scratch;
+}
+
+// Stored bytes as text for display, bytes the codec cannot decode are shown as 0x plus hex
+auto DecodeForDisplay(const CodecSpec& spec, std::string_view bytes, std::string& scratch) -> std::string_view {
+    if (spec.codec == Codec::raw) return bytes;
+    scratch.clear();
+    if (kCodecInfos[static_cast<size_t>(spec.codec)].decode(spec, bytes, scratch)) return scratch;
+    scratch.assign("0x");
+    AppendHex(scratch, bytes);
+    return scratch;
+}
+
+// Records go out decoded only here, when printed, scans and filters work on the stored bytes
+template <typename Out>
+void AppendDisplayKey(Out& out, std::string_view key) {
+    static thread_local std::string scratch;
+    out.Append(DecodeForDisplay(key_codec, key, scratch));
+}
+
+void AppendDisplayRecord(OutputBuffer& out, std::string_view key, std::string_view value) {
+    static thread_local std::string key_scratch;
+    static thread_local std::string value_scratch;
+    AppendRecord(out,
+                 RecordFormat::text,
+                 DecodeForDisplay(key_codec, key, key_scratch),
+                 DecodeForDisplay(value_codec, value, value_scratch));
+}
+
+// Log-linear histogram in the style of HdrHistogram. Values below 16 are exact, above that every power of two is
+// split into 16 linear sub-buckets, bounding the error of any percentile to 1/16 at a fixed 8 KiB footprint.
+class Histogram {
+public:
+    static constexpr int kSubBits = 4;
+    static constexpr size_t kSubBuckets = size_t{1} << kSubBits;
+    static constexpr size_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+    void Record(uint64_t value) {
+        counts_[IndexOf(value)]++;
+        count_++;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void Merge(const Histogram& other) {
+        for (size_t i = 0; i < kBuckets; i++) counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    // Upper bound of the bucket holding the p-th percentile, p in [0, 100]
+    auto Percentile(double p) const -> uint64_t {
+        if (count_ == 0) return 0;
+        const auto rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(count_ - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += counts_[i];
+            if (seen >= rank) return std::clamp(UpperBoundOf(i), min_, max_);
+        }
+        return max_;
+    }
+
+    auto count() const -> uint64_t { return count_; }
+    auto min() const -> uint64_t { return count_ == 0 ? 0 : min_; }
+    auto max() const -> uint64_t { return max_; }
+    auto Mean() const -> double { return count_ == 0 ? 0.0 : static_cast<double>(sum_) / static_cast<double>(count_); }
+
+private:
+    static auto IndexOf(uint64_t value) -> size_t {
+        if (value < kSubBuckets) return value;
+        const int shift = std::bit_width(value) - 1 - kSubBits;
+        const auto sub = (value >> shift) - kSubBuckets;
+        return (shift + 1) * kSubBuckets + sub;
+    }
+
+    static auto UpperBoundOf(size_t index) -> uint64_t {
+        const size_t bucket = index / kSubBuckets;
+        const uint64_t sub = index % kSubBuckets;
+        if (bucket == 0) return sub;
+        const int shift = static_cast<int>(bucket) - 1;
+        return ((kSubBuckets + sub + 1) << shift) - 1;
+    }
+
+    std::array<uint64_t, kBuckets> counts_{};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+};
+
+// Space-saving summary (Metwally et al.) of the heaviest items of a weighted stream in fixed memory. Any item
+// heavier than total / capacity is guaranteed to be kept, a kept item's weight is too high by at most its error.
+// A min-heap on weight finds the item to evict, index_ maps each item to its heap position.
+class SpaceSaving {
+public:
+    struct Entry {
+        std::string item;
+        uint64_t weight = 0;
+        uint64_t error = 0;
+    };
+
+    explicit SpaceSaving(size_t capacity)
+        : capacity_(std::max<size_t>(capacity, 1)) {}
+
+    void Add(std::string_view item, uint64_t weight, uint64_t error = 0) {
+        if (auto found = index_.find(item); found != index_.end()) {
+            heap_[found->second].weight += weight;
+            heap_[found->second].error += error;
+            SiftDown(found->second);
+            return;
+        }
+        if (heap_.size() < capacity_) {
+            index_.emplace(std::string(item), heap_.size());
+            heap_.push_back({std::string(item), weight, error});
+            SiftUp(heap_.size() - 1);
+            return;
+        }
+
+        // The new item takes over the lightest one, inheriting its weight as error
+        auto& lightest = heap_.front();
+        index_.erase(lightest.item);
+        lightest.error = lightest.weight + error;
+        lightest.weight += weight;
+        lightest.item.assign(item);
+        index_.emplace(lightest.item, 0);
+        SiftDown(0);
+    }
+
+    void Merge(const SpaceSaving& other) {
+        for (const auto& entry : other.heap_) Add(entry.item, entry.weight, entry.error);
+    }
+
+    // The k heaviest entries, heaviest first
+    auto Top(size_t k) const -> std::vector<Entry> {
+        auto top = heap_;
+        k = std::min(k, top.size());
+        std::partial_sort(top.begin(), top.begin() + k, top.end(), [](const Entry& a, const Entry& b) {
+            return a.weight != b.weight ? a.weight > b.weight : a.item < b.item;
+        });
+        top.resize(k);
+        return top;
+    }
+
+private:
+    struct Hash {
+        using is_transparent = void;
+        auto operator()(std::string_view item) const -> size_t { return std::hash<std::string_view>{}(item); }
+    };
+
+    void Swap(size_t a, size_t b) {
+        std::swap(heap_[a], heap_[b]);
+        index_.find(heap_[a].item)->second = a;
+        index_.find(heap_[b].item)->second = b;
+    }
+
+    void SiftUp(size_t i) {
+        for (; i != 0 && heap_[i].weight < heap_[(i - 1) / 2].weight; i = (i - 1) / 2) Swap(i, (i - 1) / 2);
+    }
+
+    void SiftDown(size_t i) {
+        for (;;) {
+            size_t lightest = i;
+            for (const size_t child : {2 * i + 1, 2 * i + 2}) {
+                if (child < heap_.size() && heap_[child].weight < heap_[lightest].weight) lightest = child;
+            }
+            if (lightest == i) return;
+            Swap(i, lightest);
+            i = lightest;
+        }
+    }
+
+    size_t capacity_;
+    std::vector<Entry> heap_;
+    std::unordered_map<std::string, size_t, Hash, std::equal_to<>> index_;
+};
+
+// An open database and the session state that belongs to it. The block cache and filter policy are referenced by
+// the db's options and must outlive it.
+struct Handle {
+    std::string name;
+    std::string path;
+    std::unique_ptr<leveldb::Cache> block_cache;
+    std::unique_ptr<const leveldb::FilterPolicy> filter_policy;
+    std::unique_ptr<leveldb::DB> db;
+    leveldb::Options options;  // As opened, for import --direct to open the db again
+    std::optional<PendingBatch> pending_batch;
+
+    // Pinned by the snapshot instruction until release or close. While set every read, scan, mget, count and export
+    // sees the db as it was at that moment.
+    const leveldb::Snapshot* snapshot = nullptr;
+    std::chrono::steady_clock::time_point snapshot_taken;
+
+    bool read_only = false;
+    fs::path copy_dir;                   // Checkpoint made by open --copy, removed again on close
+};
+
+std::vector<std::unique_ptr<Handle>> handles;
+// Target of every command, switched by use and for one command by @name. Jobs and their workers set their own.
+thread_local Handle* current = nullptr;
+
+// A command started with a trailing &, or the one running in the foreground. Background jobs run on their own thread
+// against the database they were started on. The loops of long commands add to the progress counters and stop with
+// a "cancelled" status once cancel is set, by the cancel instruction or SIGINT for the foreground command.
+struct Job {
+    uint64_t id = 0;
+    std::string command;
+    Handle* handle = nullptr;
+    std::vector<std::string> args;  // Owned copies, the parser reuses its buffer for the next line
+    bool cancellable = true;        // False for compact, leveldb's CompactRange always runs to its end
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    std::atomic<bool> cancel = false;
+    std::atomic<bool> finished = false;
+    std::atomic<uint64_t> rows = 0;
+    std::atomic<uint64_t> bytes = 0;
+    std::jthread thread;
+};
+
+std::vector<std::unique_ptr<Job>> jobs;  // Background jobs, only touched by the main thread
+uint64_t next_job_id = 1;
+thread_local Job* current_job = nullptr;       // Job the thread works for, inherited by ParallelFor workers
+std::atomic<Job*> foreground_job = nullptr;  // Cancelled by SIGINT
+
+// Set by a SIGINT that has no foreground command left to cancel. The handler only sets it and writes a byte to
+// interrupt_pipe to wake the prompt, the main thread leaves through ExitOnInterrupt between commands.
+std::atomic<bool> interrupted = false;
+std::array<int, 2> interrupt_pipe = {-1, -1};
+// Bumped after every command that may change a db and on close, drops the key completions cached before it
+std::atomic<uint64_t> write_generation = 0;
+
+auto Cancelled() -> leveldb::Status { return leveldb::Status::IOError("cancelled"); }
+
+// Adds a worker's rows to the counters of its job in batches, so parallel workers rarely touch the shared atomics,
+// and polls for cancellation at the same interval
+class JobTicker {
+public:
+    static constexpr uint64_t kRows = 1024;
+
+    JobTicker() = default;
+    JobTicker(const JobTicker&) = delete;
+    auto operator=(const JobTicker&) -> JobTicker& = delete;
+    ~JobTicker() { Flush(); }
+
+    // False once the job is cancelled
+    auto Tick(uint64_t bytes) -> bool {
+        rows_++;
+        bytes_ += bytes;
+        return rows_ < kRows || Flush();
+    }
+
+    auto Flush() -> bool {
+        if (job_ == nullptr) return true;
+        job_->rows.fetch_add(rows_, std::memory_order_relaxed);
+        job_->bytes.fetch_add(bytes_, std::memory_order_relaxed);
+        rows_ = 0;
+        bytes_ = 0;
+        return !job_->cancel.load(std::memory_order_relaxed);
+    }
+
+private:
+    Job* job_ = current_job;
+    uint64_t rows_ = 0;
+    uint64_t bytes_ = 0;
+};
+
+auto InBackground() -> bool { return current_job != nullptr && current_job->id != 0; }
+
+// Joins background jobs that are done, their result was printed by the job itself
+void ReapJobs() {
+    std::erase_if(jobs, [](const auto& job) { return job->finished.load(); });
+}
+
+// Cancels the background jobs reading or writing handle and waits for them, before it is closed
+void CancelJobs(const Handle& handle) {
+    for (auto& job : jobs) {
+        if (job->handle != &handle || job->finished) continue;
+        println("{} job [{}] {}", job->cancellable ? "cancelling" : "waiting for", job->id, job->command);
+        job->cancel = true;
+    }
+    std::erase_if(jobs, [&](const auto& job) { return job->handle == &handle; });
+}
+
+// Lets the background jobs run to completion, at the end of a script
+void WaitForJobs() {
+    static constexpr auto kPollInterval = std::chrono::milliseconds(50);
+    while (std::ranges::any_of(jobs, [](const auto& job) { return !job->finished; })) {
+        if (interrupted) {
+            for (auto& job : jobs) job->cancel = true;
+        }
+        std::this_thread::sleep_for(kPollInterval);
+    }
+    jobs.clear();
+}
+
+auto FindHandle(std::string_view name) -> Handle* {
+    auto it = std::ranges::find(handles, name, &Handle::name);
+    return it == handles.end() ? nullptr : it->get();
+}
+
+auto SessionReadOptions(const Handle& handle = *current) -> leveldb::ReadOptions {
+    leveldb::ReadOptions opts{};
+    opts.snapshot = handle.snapshot;
+    return opts;
+}
+
+// Releases a snapshot taken for the duration of one command. Reads share the session snapshot instead when one is
+// pinned, commands deleting what they read pass use_session = false to work on the latest state.
+class ScopedSnapshot {
+public:
+    explicit ScopedSnapshot(const Handle& handle, bool use_session = true)
+        : db_(handle.db.get()),
+          session_(use_session ? handle.snapshot : nullptr),
+          snapshot_(session_ != nullptr ? nullptr : db_->GetSnapshot()) {}
+    ScopedSnapshot(const ScopedSnapshot&) = delete;
+    auto operator=(const ScopedSnapshot&) -> ScopedSnapshot& = delete;
+    ~ScopedSnapshot() {
+        if (snapshot_ != nullptr) db_->ReleaseSnapshot(snapshot_);
+    }
+
+    auto get() const -> const leveldb::Snapshot* { return snapshot_ != nullptr ? snapshot_ : session_; }
+
+private:
+    leveldb::DB* db_;
+    const leveldb::Snapshot* session_;
+    const leveldb::Snapshot* snapshot_;
+};
+
+// Half-open key range [start, end), without an end it runs to the last key
+struct KeyRange {
+    std::string start;
+    std::optional<std::string> end;
+
+    auto BeforeEnd(const leveldb::Slice& key) const -> bool { return !end || key.compare(*end) < 0; }
+
+    static auto Prefix(std::string_view prefix) -> KeyRange {
+        KeyRange range{std::string(prefix), std::string(prefix)};
+        // Smallest key greater than every key with this prefix: drop trailing 0xff bytes and increment the last one
+        auto& end = *range.end;
+        while (!end.empty() && static_cast<uint8_t>(end.back()) == 0xff) end.pop_back();
+        if (end.empty()) {
+            range.end.reset();
+        } else {
+            end.back() = static_cast<char>(static_cast<uint8_t>(end.back()) + 1);
+        }
+        return range;
+    }
+};
+
+// [start] [end] as typed, in the bytes of the key codec, a missing bound leaves that side open
+auto EncodeRange(ArgsVector bounds, std::string_view command) -> std::optional<KeyRange> {
+    KeyRange range{};
+    std::string scratch;
+    if (!bounds.empty()) {
+        const auto start = EncodeArgument(key_codec, bounds[0], scratch, std::string(command) + " start");
+        if (!start) return std::nullopt;
+        range.start = *start;
+    }
+    if (bounds.size() >= 2) {
+        const auto end = EncodeArgument(key_codec, bounds[1], scratch, std::string(command) + " end");
+        if (!end) return std::nullopt;
+        range.end = std::string(*end);
+    }
+    return range;
+}
+
+// Positions it on the first record of range and walks it in order, stopping at the bound or when fn returns false
+template <typename F>
+auto ScanRange(leveldb::Iterator& it, const KeyRange& range, bool reverse, F fn) -> leveldb::Status {
+    JobTicker ticker;
+    if (!reverse) {
+        for (it.Seek(range.start); it.Valid() && range.BeforeEnd(it.key()); it.Next()) {
+            if (!ticker.Tick(it.key().size() + it.value().size())) return Cancelled();
+            if (!fn(it)) break;
+        }
+        return it.status();
+    }
+
+    if (range.end) {
+        it.Seek(*range.end);
+        if (it.Valid()) {
+            it.Prev();
+        } else {
+            it.SeekToLast();
+        }
+    } else {
+        it.SeekToLast();
+    }
+    for (; it.Valid() && it.key().compare(range.start) >= 0; it.Prev()) {
+        if (!ticker.Tick(it.key().size() + it.value().size())) return Cancelled();
+        if (!fn(it)) break;
+    }
+    return it.status();
+}
+
+// Keeps the first error reported by any worker of a parallel operation
+class FirstError {
+public:
+    void Set(leveldb::Status status) {
+        std::lock_guard lock(mutex_);
+        if (!failed_) status_ = std::move(status);
+        failed_ = true;
+    }
+
+    auto failed() const -> bool { return failed_.load(std::memory_order_relaxed); }
+    auto status() const -> const leveldb::Status& { return status_; }
+
+private:
+    std::mutex mutex_;
+    std::atomic<bool> failed_ = false;
+    leveldb::Status status_;
+};
+
+auto DefaultThreads() -> size_t { return std::max(1u, std::thread::hardware_concurrency()); }
+
+// Runs fn(task) for every task in [0, tasks) on up to threads workers, each claiming the next unstarted task
+template <typename F>
+void ParallelFor(size_t tasks, size_t threads, F fn) {
+    threads = std::min(threads, tasks);
+    if (threads <= 1) {
+        for (size_t i = 0; i < tasks; i++) fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next = 0;
+    std::vector<std::jthread> workers;
+    workers.reserve(threads);
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, handle = current, job = current_job] {
+            current = handle;
+            current_job = job;
+            for (size_t i = next++; i < tasks; i = next++) fn(i);
+        });
+    }
+}
+
+// Up to count keys strictly between first and last, spread evenly over the 8 bytes following their common prefix
+auto InterpolateKeys(const std::string& first, const std::string& last, size_t count) -> std::vector<std::string> {
+    const size_t common = std::ranges::mismatch(first, last).in1 - first.begin();
+    const auto load = [&](const std::string& key) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8; i++) {
+            value = (value << 8) | (common + i < key.size() ? static_cast<uint8_t>(key[common + i]) : 0);
+        }
+        return value;
+    };
+
+    const uint64_t low = load(first);
+    const uint64_t high = load(last);
+    std::vector<std::string> keys;
+    if (high <= low) return keys;
+
+    uint64_t previous = low;
+    for (size_t i = 1; i < count; i++) {
+        const auto value = low + static_cast<uint64_t>(static_cast<unsigned __int128>(high - low) * i / count);
+        if (value == previous) continue;
+        previous = value;
+
+        auto& key = keys.emplace_back(first, 0, common);
+        for (int shift = 56; shift >= 0; shift -= 8) key.push_back(static_cast<char>(value >> shift));
+    }
+    return keys;
+}
+
+// Cuts range into up to parts sub-ranges of about equal size on disk. Candidate boundaries are interpolated between the
+// first and last key of the range, GetApproximateSizes measures the slices between them in one call and adjacent
+// slices are merged greedily. Memtable contents are not counted by leveldb, so a db that was never flushed splits
+// evenly over the candidates instead.
+auto SplitRange(const Handle& handle, const KeyRange& range, size_t parts) -> std::vector<KeyRange> {
+    static constexpr size_t kCandidatesPerPart = 16;
+    if (parts <= 1) return {range};
+
+    std::string first;
+    std::string last;
+    {
+        auto opts = SessionReadOptions(handle);
+        opts.fill_cache = false;
+        auto it = std::unique_ptr<leveldb::Iterator>(handle.db->NewIterator(opts));
+        ScanRange(*it, range, false, [&](leveldb::Iterator& row) {
+            first = row.key().ToString();
+            return false;
+        });
+        ScanRange(*it, range, true, [&](leveldb::Iterator& row) {
+            last = row.key().ToString();
+            return false;
+        });
+    }
+    if (first >= last) return {range};
+
+    const auto candidates = InterpolateKeys(first, last, parts * kCandidatesPerPart);
+    if (candidates.empty()) return {range};
+
+    // Slice j spans [edge j, edge j + 1) with edges first, candidates..., and the key right after last
+    const auto after_last = last + '\0';
+    std::vector<leveldb::Range> slices;
+    slices.reserve(candidates.size() + 1);
+    for (size_t j = 0; j <= candidates.size(); j++) {
+        const auto& start = j == 0 ? first : candidates[j - 1];
+        const auto& limit = j == candidates.size() ? after_last : candidates[j];
+        slices.emplace_back(start, limit);
+    }
+    std::vector<uint64_t> sizes(slices.size());
+    handle.db->GetApproximateSizes(slices.data(), static_cast<int>(slices.size()), sizes.data());
+
+    const uint64_t total = std::accumulate(sizes.begin(), sizes.end(), uint64_t{0});
+    std::vector<KeyRange> result;
+    std::string start = range.start;
+    uint64_t cumulative = 0;
+    for (size_t j = 0; j < candidates.size() && result.size() + 1 < parts; j++) {
+        cumulative += sizes[j];
+        // Cut once the slices so far reach the next equal share, by bytes or, without any, by slice count
+        const bool cut = total != 0 ? cumulative * parts >= total * (result.size() + 1)
+                                    : (j + 1) * parts >= slices.size() * (result.size() + 1);
+        if (!cut) continue;
+        result.push_back({std::move(start), candidates[j]});
+        start = candidates[j];
+    }
+    result.push_back({std::move(start), range.end});
+    return result;
+}
+
+Durability durability;
+std::array<Histogram, enchantum::count<Instruction>> command_latency;  // Nanoseconds per dispatch
+bool print_timing = false;
+
+constexpr auto ViewToSlice(std::string_view view) -> leveldb::Slice;
+auto SliceToView(const leveldb::Slice& slice) -> std::string_view;
+constexpr auto GetInfo(Instruction inst) -> const InstructionInfo&;
+constexpr auto InstructionName(Instruction inst) -> std::string_view;
+auto ParseCommandArgs(const ArgsVector& args,
+                      std::initializer_list<std::string_view> switches,
+                      std::initializer_list<std::string_view> valued) -> std::optional<CommandArgs>;
+void DiscardPendingBatch(Handle& handle);
+void ReleaseSessionSnapshot(Handle& handle);
+void SyncPendingGroup();
+void CloseHandle(Handle& handle);
+void CloseAllHandles();
+
+struct ExitFunctor {
+    void operator()() const {
+        CloseAllHandles();
+        std::exit(script_mode && error_count != 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+};
+
+void ExitOnInterrupt() {
+    if (!interrupted) return;
+    println("\nUser Interrupt");
+    ExitFunctor()();
+}
+
+struct PrintHelpFunctor {
+    static constexpr auto kPrintFmt = "{:<15}{:<32}{:<20}";
+
+    void operator()() const {
+        println("Help\n");
+        println("Input format is: <instruction> <args>");
+        println("Example: open ./database.ldb\n");
+        println(kPrintFmt, "Instruction", "Arguments", "Description");
+        enchantum::for_each<Instruction>([&](auto c) {
+            const auto& info = GetInfo(c.value);
+            if (info.aliases.empty()) {
+                println(kPrintFmt, InstructionName(c.value), info.args.data, info.description);
+            } else {
+                println(kPrintFmt, InstructionName(c.value), info.args.data,
+                        std::format("{} (also: {})", info.description, info.aliases));
+            }
+        });
+        println("\nAny unambiguous abbreviation of an instruction works as well, e.g. 'ro' for rollback");
+    }
+};
+
+struct CloseFunctor {
+    void operator()(const ArgsVector& args) const {
+        // Checked here rather than by require_db, so close <name> works while no database is current
+        if (args.empty() && current == nullptr) {
+            PrintError("close requires Opened Database");
+            return;
+        }
+        auto* handle = args.empty() ? current : FindHandle(args[0]);
+        if (handle == nullptr) {
+            PrintError("close no open database named '{}'", args[0]);
+            return;
+        }
+        CloseHandle(*handle);
+        println("OK");
+    }
+};
+
+// Switches the database later commands go to, lists the open ones without a name
+struct UseFunctor {
+    void operator()(const ArgsVector& args) const {
+        if (args.empty()) {
+            for (const auto& handle : handles) {
+                println("{}{} {}{}", handle.get() == current ? "* " : "  ", handle->name, handle->path,
+                        handle->read_only ? " (read-only copy)" : "");
+            }
+            return;
+        }
+        auto* handle = FindHandle(args[0]);
+        if (handle == nullptr) {
+            PrintError("use no open database named '{}'", args[0]);
+            return;
+        }
+        current = handle;
+        println("OK");
+    }
+};
+
+struct DumpFunctor {
+    void operator()() const {
+        auto opts = SessionReadOptions();
+        opts.fill_cache = false;
+        auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(opts));
+
+        OutputBuffer out(stdout);
+        const auto status = ScanRange(*it, KeyRange{}, false, [&](leveldb::Iterator& row) {
+            AppendDisplayRecord(out, SliceToView(row.key()), SliceToView(row.value()));
+            return true;
+        });
+        out.Flush();
+
+        if (!status.ok()) {
+            PrintError("dump status='{}'", status.ToString());
+        }
+    }
+};
+
+struct CheckpointStats {
+    size_t linked = 0;
+    size_t copied = 0;
+    uint64_t copied_bytes = 0;
+    size_t skipped = 0;  // Already in place, backup --incremental
+};
+
+// Table files are never modified once written and are hard linked, falling back to a copy across file systems
+auto LinkOrCopy(const fs::path& from, const fs::path& to, CheckpointStats& stats) -> std::error_code {
+    std::error_code ec;
+    fs::create_hard_link(from, to, ec);
+    if (!ec) {
+        stats.linked++;
+        return ec;
+    }
+    if (ec == std::errc::no_such_file_or_directory) return ec;
+
+    ec.clear();
+    fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+    if (!ec) {
+        stats.copied++;
+        stats.copied_bytes += fs::file_size(to, ec);
+    }
+    return ec;
+}
+
+auto CopyFile(const fs::path& from, const fs::path& to, CheckpointStats& stats) -> std::error_code {
+    std::error_code ec;
+    fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+    if (!ec) {
+        stats.copied++;
+        stats.copied_bytes += fs::file_size(to, ec);
+    }
+    return ec;
+}
+
+// Turns dst into a copy of the db in src that opens without src's LOCK and shares its tables. Tables are linked
+// first, then CURRENT, the MANIFESTs and logs are copied and tables created meanwhile linked. A concurrent
+// compaction can still delete a table the copied MANIFEST needs, the caller retries when opening the copy fails.
+auto CheckpointDatabase(const fs::path& src, const fs::path& dst) -> std::expected<CheckpointStats, std::string> {
+    const auto is_table = [](const fs::path& file) { return file.extension() == ".ldb" || file.extension() == ".sst"; };
+    const auto fail = [](std::string_view what, const fs::path& file, const std::error_code& ec) {
+        return std::unexpected(std::format("{} {} '{}'", what, file.string(), ec.message()));
+    };
+
+    CheckpointStats stats;
+    std::error_code ec;
+    fs::remove_all(dst, ec);
+    fs::create_directories(dst, ec);
+    if (ec) return fail("create", dst, ec);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (const auto& entry : fs::directory_iterator(src, ec)) {
+            const auto& file = entry.path();
+            const auto target = dst / file.filename();
+            if (is_table(file)) {
+                if (fs::exists(target)) continue;
+                ec = LinkOrCopy(file, target, stats);
+                // Gone since the listing, compacted away and not referenced by the MANIFEST copied below
+                if (ec == std::errc::no_such_file_or_directory && pass == 0) continue;
+                if (ec) return fail("link", file, ec);
+            } else if (pass == 1 && (file.extension() == ".log" || file.filename().string().starts_with("MANIFEST-"))) {
+                ec = CopyFile(file, target, stats);
+                if (ec && ec != std::errc::no_such_file_or_directory) return fail("copy", file, ec);
+            }
+        }
+        if (ec) return fail("list", src, ec);
+
+        // CURRENT before the MANIFESTs so the one it names is still there when the directory is listed again
+        if (pass == 0) {
+            ec = CopyFile(src / "CURRENT", dst / "CURRENT", stats);
+            if (ec) return fail("copy", src / "CURRENT", ec);
+        }
+    }
+    return stats;
+}
+
+struct OpenFunctor {
+    static constexpr std::string_view kDefaultName = "default";
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(
+            args,
+            {"--copy"},
+            {"--cache-mb", "--write-buffer-mb", "--block-size", "--bloom-bits", "--max-open-files", "--compression"});
+        if (!cmd) return;
+        if (cmd->positional.empty() || cmd->positional.size() > 2) {
+            PrintError("open expected [name] <path>");
+            return;
+        }
+
+        leveldb::Options opts{};
+        opts.create_if_missing = true;
+        opts.reuse_logs = true;
+        auto cache_mb = cmd->GetNumber<size_t>("--cache-mb", 0);
+        auto write_buffer_mb = cmd->GetNumber<size_t>("--write-buffer-mb", 0);
+        auto block_size = cmd->GetNumber<size_t>("--block-size", opts.block_size);
+        auto bloom_bits = cmd->GetNumber<int>("--bloom-bits", 0);
+        auto max_open_files = cmd->GetNumber<int>("--max-open-files", opts.max_open_files);
+        auto compression = ParseCompression(cmd->Get("--compression").value_or("snappy"));
+        if (!cache_mb || !write_buffer_mb || !block_size || !bloom_bits || !max_open_files || !compression) return;
+
+        if (*write_buffer_mb != 0) opts.write_buffer_size = *write_buffer_mb << 20;
+        opts.block_size = *block_size;
+        opts.max_open_files = *max_open_files;
+        opts.compression = *compression;
+
+        // Without a name the current database is replaced, so a session using one db never needs names
+        auto name = std::string(cmd->positional.size() == 2 ? cmd->positional[0]
+                                : current != nullptr        ? std::string_view(current->name)
+                                                            : kDefaultName);
+        if (auto* existing = FindHandle(name)) CloseHandle(*existing);
+        auto& handle = *handles.emplace_back(std::make_unique<Handle>());
+        handle.name = std::move(name);
+        handle.path = std::string(cmd->positional.back());
+
+        // Without --cache-mb leveldb falls back to its internal 8 MB cache
+        if (*cache_mb != 0) handle.block_cache.reset(leveldb::NewLRUCache(*cache_mb << 20));
+        if (*bloom_bits != 0) handle.filter_policy.reset(leveldb::NewBloomFilterPolicy(*bloom_bits));
+        opts.block_cache = handle.block_cache.get();
+        opts.filter_policy = handle.filter_policy.get();
+
+        handle.options = opts;
+        if (cmd->Has("--copy")) {
+            OpenCopy(opts, handle);
+            return;
+        }
+        const auto status = leveldb::DB::Open(opts, handle.path, std::out_ptr(handle.db));
+        if (!status.ok()) {
+            PrintError("open {} status='{}'", handle.path, status.ToString());
+            CloseHandle(handle);
+            return;
+        }
+        current = &handle;
+        println("OK");
+    }
+
+    // Opens a checkpoint next to path so a db locked by a running process can be inspected. Nothing under path is
+    // written: the logs are copies and replayed into the copy's own files since reuse_logs is off.
+    static void OpenCopy(leveldb::Options opts, Handle& handle) {
+        static constexpr int kAttempts = 3;
+        opts.create_if_missing = false;
+        opts.reuse_logs = false;
+
+        auto src = fs::absolute(handle.path).lexically_normal();
+        if (!src.has_filename()) src = src.parent_path();
+        handle.copy_dir = src;
+        handle.copy_dir += std::format(".repl-copy-{}", getpid());
+
+        const auto start = std::chrono::steady_clock::now();
+        for (int attempt = 1;; attempt++) {
+            auto stats = CheckpointDatabase(src, handle.copy_dir);
+            if (!stats) {
+                PrintError("open --copy {}", stats.error());
+                CloseHandle(handle);
+                return;
+            }
+
+            const auto status = leveldb::DB::Open(opts, handle.copy_dir.string(), std::out_ptr(handle.db));
+            if (status.ok()) {
+                handle.read_only = true;
+                current = &handle;
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                println("OK read-only copy in {} ({} linked, {} copied, {:.1f} MB in {:.2f}s)",
+                        handle.copy_dir.string(),
+                        stats->linked,
+                        stats->copied,
+                        static_cast<double>(stats->copied_bytes) / (1 << 20),
+                        elapsed.count());
+                return;
+            }
+            if (attempt == kAttempts) {
+                PrintError("open --copy {} status='{}'", handle.path, status.ToString());
+                CloseHandle(handle);
+                return;
+            }
+        }
+    }
+
+    static auto ParseCompression(std::string_view name) -> std::optional<leveldb::CompressionType> {
+        if (name == "snappy") return leveldb::kSnappyCompression;
+        if (name == "zstd") return leveldb::kZstdCompression;
+        if (name == "none") return leveldb::kNoCompression;
+        PrintError("open unknown compression '{}' expected snappy|zstd|none", name);
+        return std::nullopt;
+    }
+};
+
+auto FlushBatch() -> leveldb::Status {
+    auto status = current->db->Write(durability.NextWrite(current->pending_batch->ops), &current->pending_batch->batch);
+    if (status.ok()) {
+        current->pending_batch->batch.Clear();
+        current->pending_batch->ops = 0;
+    }
+    return status;
+}
+
+void AddToBatch() {
+    auto& pending = *current->pending_batch;
+    pending.ops++;
+    const bool flush = (pending.max_ops != 0 && pending.ops >= pending.max_ops) ||
+                       (pending.max_bytes != 0 && pending.batch.ApproximateSize() >= pending.max_bytes);
+    if (!flush) {
+        println("OK");
+        return;
+    }
+
+    const auto ops = pending.ops;
+    const auto status = FlushBatch();
+    if (!status.ok()) {
+        PrintError("auto-flush of {} ops status='{}'", ops, status.ToString());
+        return;
+    }
+    println("OK (auto-flushed {} ops)", ops);
+}
+
+// Finishes an open every/interval group so unsynced writes are not left behind on close. The group may have
+// written to any open database, all of them are synced.
+void SyncPendingGroup() {
+    std::lock_guard lock(durability.mutex);
+    if (durability.unsynced_ops == 0) return;
+
+    leveldb::WriteBatch empty;
+    leveldb::WriteOptions opts{};
+    opts.sync = true;
+    for (const auto& handle : handles) {
+        const auto status = handle->db->Write(opts, &empty);
+        if (!status.ok()) {
+            PrintError("sync of {} pending ops on {} status='{}'", durability.unsynced_ops, handle->name,
+                       status.ToString());
+            durability.last_sync = Durability::Clock::now();  // Retried an interval later, not in a loop
+            return;
+        }
+        durability.syncs++;
+    }
+    durability.unsynced_ops = 0;
+    durability.last_sync = Durability::Clock::now();
+}
+
+void SyncDueGroup() {
+    if (const auto due = durability.UntilDue(); due && *due == Durability::Clock::duration::zero()) SyncPendingGroup();
+}
+
+// Also cleans up after a failed open, the handle may not have a db yet
+void CloseHandle(Handle& handle) {
+    CancelJobs(handle);
+    write_generation++;
+    if (handle.db != nullptr) {
+        DiscardPendingBatch(handle);
+        ReleaseSessionSnapshot(handle);
+        SyncPendingGroup();
+    }
+    handle.db.reset();
+    handle.filter_policy.reset();
+    handle.block_cache.reset();
+
+    if (!handle.copy_dir.empty()) {
+        std::error_code ec;
+        fs::remove_all(handle.copy_dir, ec);
+        if (ec) println("warning: could not remove copy {} '{}'", handle.copy_dir.string(), ec.message());
+    }
+    if (current == &handle) current = nullptr;
+    std::erase_if(handles, [&](const auto& open) { return open.get() == &handle; });
+}
+
+void CloseAllHandles() {
+    while (!handles.empty()) CloseHandle(*handles.back());
+}
+
+void ReleaseSessionSnapshot(Handle& handle) {
+    if (handle.snapshot == nullptr) return;
+    handle.db->ReleaseSnapshot(handle.snapshot);
+    handle.snapshot = nullptr;
+}
+
+void DiscardPendingBatch(Handle& handle) {
+    if (!handle.pending_batch) return;
+    if (handle.pending_batch->ops != 0) {
+        println("warning: discarding {} uncommitted ops of {}", handle.pending_batch->ops, handle.name);
+    }
+    handle.pending_batch.reset();
+}
+
+struct SnapshotFunctor {
+    void operator()() const {
+        if (current->snapshot != nullptr) {
+            PrintError("snapshot already held, release it first");
+            return;
+        }
+        ReapJobs();
+        if (std::ranges::any_of(jobs, [](const auto& job) { return job->handle == current; })) {
+            PrintError("snapshot background jobs are reading this db, wait for them or cancel them");
+            return;
+        }
+        current->snapshot = current->db->GetSnapshot();
+        current->snapshot_taken = std::chrono::steady_clock::now();
+        println("OK (reads see the db as of now until release)");
+    }
+};
+
+struct ReleaseFunctor {
+    void operator()() const {
+        if (current->snapshot == nullptr) {
+            PrintError("release no snapshot held");
+            return;
+        }
+        ReapJobs();
+        if (std::ranges::any_of(jobs, [](const auto& job) { return job->handle == current; })) {
+            PrintError("release background jobs still read the snapshot, wait for them or cancel them");
+            return;
+        }
+        ReleaseSessionSnapshot(*current);
+        println("OK");
+    }
+};
+
+struct JobsFunctor {
+    void operator()() const {
+        ReapJobs();
+        if (jobs.empty()) {
+            println("no background jobs");
+            return;
+        }
+        for (const auto& job : jobs) {
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job->started).count();
+            const auto rows = job->rows.load();
+            println("[{}] {:<10} {:>8.1f}s {:>12} rows {:>10.1f} MB {:>10.0f} rows/s  {} ({})",
+                    job->id,
+                    job->cancel ? "cancelling" : "running",
+                    seconds,
+                    rows,
+                    static_cast<double>(job->bytes.load()) / (1 << 20),
+                    seconds > 0 ? static_cast<double>(rows) / seconds : 0.0,
+                    job->command,
+                    job->handle->name);
+        }
+    }
+};
+
+struct CancelFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto id = ParseNumber<uint64_t>(args[0], "cancel");
+        if (!id) return;
+        ReapJobs();
+        const auto job = std::ranges::find_if(jobs, [&](const auto& job) { return job->id == *id; });
+        if (job == jobs.end()) {
+            PrintError("cancel no running job [{}]", *id);
+            return;
+        }
+        if (!(*job)->cancellable) {
+            PrintError("cancel [{}] {} cannot be stopped, it runs to its end", *id, (*job)->command);
+            return;
+        }
+        (*job)->cancel = true;
+        println("OK (cancelling [{}])", *id);
+    }
+};
+
+struct BeginFunctor {
+    void operator()(const ArgsVector& args) const {
+        if (current->pending_batch) {
+            PrintError("begin batch already in progress");
+            return;
+        }
+
+        auto cmd = ParseCommandArgs(args, {}, {"--max-ops", "--max-bytes"});
+        if (!cmd) return;
+        auto max_ops = cmd->GetNumber<size_t>("--max-ops", 0);
+        auto max_bytes = cmd->GetNumber<size_t>("--max-bytes", 0);
+        if (!max_ops || !max_bytes) return;
+
+        current->pending_batch.emplace();
+        current->pending_batch->max_ops = *max_ops;
+        current->pending_batch->max_bytes = *max_bytes;
+        println("OK");
+    }
+};
+
+struct CommitFunctor {
+    void operator()() const {
+        if (!current->pending_batch) {
+            PrintError("commit no batch in progress");
+            return;
+        }
+
+        const auto ops = current->pending_batch->ops;
+        const auto status = FlushBatch();
+        if (!status.ok()) {
+            PrintError("commit {} ops status='{}'", ops, status.ToString());
+            return;
+        }
+        current->pending_batch.reset();
+        println("OK ({} ops)", ops);
+    }
+};
+
+struct RollbackFunctor {
+    void operator()() const {
+        if (!current->pending_batch) {
+            PrintError("rollback no batch in progress");
+            return;
+        }
+
+        const auto ops = current->pending_batch->ops;
+        current->pending_batch.reset();
+        println("OK (discarded {} ops)", ops);
+    }
+};
+
+struct WriteFunctor {
+    void operator()(const ArgsVector& args) const {
+        std::string key_scratch;
+        std::string value_scratch;
+        const auto key = EncodeArgument(key_codec, args[0], key_scratch, "write key");
+        const auto value = key ? EncodeArgument(value_codec, args[1], value_scratch, "write value") : std::nullopt;
+        if (!value) return;
+        Write(*key, *value, args);
+    }
+
+    static void Write(std::string_view key, std::string_view value, const ArgsVector& args) {
+        if (current->pending_batch) {
+            current->pending_batch->batch.Put(ViewToSlice(key), ViewToSlice(value));
+            AddToBatch();
+            return;
+        }
+
+        const auto status = current->db->Put(durability.NextWrite(1), ViewToSlice(key), ViewToSlice(value));
+        if (!status.ok()) {
+            PrintError("write {} {} status='{}'", args[0], args[1], status.ToString());
+            return;
+        }
+        println("OK");
+    }
+};
+
+// Looks the key up with an iterator and writes the value straight from the block it lives in, never copying it
+struct ReadFunctor {
+    static constexpr size_t kChunk = 64 << 10;
+    static constexpr size_t kHexWidth = 16;
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {"--hex"}, {"--head", "--offset", "--out"});
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("read expected one key");
+            return;
+        }
+        std::string key_scratch;
+        const auto key = EncodeArgument(key_codec, cmd->positional[0], key_scratch, "read key");
+        if (!key) return;
+        auto head = cmd->GetNumber<uint64_t>("--head", 0);
+        auto offset = cmd->GetNumber<uint64_t>("--offset", 0);
+        if (!head || !offset) return;
+
+        FilePtr owned{nullptr, &std::fclose};
+        if (auto path = cmd->Get("--out")) {
+            owned.reset(std::fopen(std::string(*path).c_str(), "wb"));
+            if (owned == nullptr) {
+                PrintError("read {} '{}'", *path, std::strerror(errno));
+                return;
+            }
+        }
+        std::FILE* file = owned != nullptr ? owned.get() : stdout;
+
+        auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(SessionReadOptions()));
+        it->Seek(ViewToSlice(*key));
+        if (!it->Valid() || it->key() != ViewToSlice(*key)) {
+            const auto status = it->status().ok() ? leveldb::Status::NotFound(leveldb::Slice()) : it->status();
+            PrintError("read {} status='{}'", cmd->positional[0], status.ToString());
+            return;
+        }
+
+        // A value codec decodes the whole value first, the window then applies to the decoded text.
+        // --hex and --out stay on the stored bytes.
+        std::string decoded;
+        auto value = SliceToView(it->value());
+        if (value_codec.codec != Codec::raw && !cmd->Has("--hex") && owned == nullptr) {
+            value = DecodeForDisplay(value_codec, value, decoded);
+        }
+
+        // --head 0 means up to the end of the value
+        const auto start = std::min<uint64_t>(*offset, value.size());
+        const auto window = value.substr(start, *head == 0 ? std::string_view::npos : *head);
+        const bool ok = cmd->Has("--hex") ? WriteHex(file, window, start) : WriteRaw(file, window, owned == nullptr);
+        if (!ok) {
+            PrintError("read write failed '{}'", std::strerror(errno));
+            return;
+        }
+
+        const auto rest = value.size() - start - window.size();
+        if (owned != nullptr) {
+            println("OK wrote {} of {} bytes", window.size(), value.size());
+        } else if (rest != 0) {
+            println("... {} more bytes, continue with --offset {}", rest, start + window.size());
+        }
+    }
+
+    static auto WriteRaw(std::FILE* file, std::string_view data, bool terminal) -> bool {
+        for (size_t pos = 0; pos < data.size(); pos += kChunk) {
+            const auto chunk = data.substr(pos, kChunk);
+            if (std::fwrite(chunk.data(), 1, chunk.size(), file) != chunk.size()) return false;
+        }
+        if (terminal) std::fputc('\n', file);
+        return std::fflush(file) == 0;
+    }
+
+    // xxd layout: offset, 16 bytes in groups of two, then the printable ones
+    static auto WriteHex(std::FILE* file, std::string_view data, uint64_t base) -> bool {
+        OutputBuffer out(file);
+        for (size_t pos = 0; pos < data.size(); pos += kHexWidth) {
+            const auto line = data.substr(pos, kHexWidth);
+            char offset[8];
+            for (int i = 7, shift = 0; i >= 0; i--, shift += 4) offset[i] = kHexDigits[((base + pos) >> shift) & 0xf];
+            out.Append(std::string_view(offset, sizeof(offset)));
+            out.Append(':');
+
+            for (size_t i = 0; i < kHexWidth; i++) {
+                if (i % 2 == 0) out.Append(' ');
+                if (i >= line.size()) {
+                    out.Append("  ");
+                    continue;
+                }
+                const auto byte = static_cast<uint8_t>(line[i]);
+                out.Append(kHexDigits[byte >> 4]);
+                out.Append(kHexDigits[byte & 0xf]);
+            }
+            out.Append("  ");
+            for (const char c : line) out.Append(c >= ' ' && c <= '~' ? c : '.');
+            out.Append('\n');
+        }
+        return out.Flush();
+    }
+};
+
+struct RemoveFunctor {
+    void operator()(const ArgsVector& args) const {
+        std::string scratch;
+        const auto key = EncodeArgument(key_codec, args[0], scratch, "remove key");
+        if (!key) return;
+        if (current->pending_batch) {
+            current->pending_batch->batch.Delete(ViewToSlice(*key));
+            AddToBatch();
+            return;
+        }
+
+        const auto status = current->db->Delete(durability.NextWrite(1), ViewToSlice(*key));
+        if (!status.ok()) {
+            PrintError("remove {} status='{}'", args[0], status.ToString());
+            return;
+        }
+        println("OK");
+    }
+};
+
+// leveldb's internal keys, as stored in tables: the user key and an 8 byte little endian tag of sequence number << 8
+// | value type. leveldb keeps its own helpers for them private.
+struct InternalKey {
+    static constexpr size_t kTagSize = 8;
+    static constexpr uint8_t kTypeValue = 1;  // 0 is a deletion
+
+    // UserKey and Tag expect a valid key
+    static auto Valid(const leveldb::Slice& key) -> bool {
+        return key.size() >= kTagSize && static_cast<uint8_t>(key[key.size() - kTagSize]) <= kTypeValue;
+    }
+
+    static auto UserKey(const leveldb::Slice& key) -> leveldb::Slice { return {key.data(), key.size() - kTagSize}; }
+
+    static auto Tag(const leveldb::Slice& key) -> uint64_t {
+        uint64_t tag = 0;
+        for (size_t i = 0; i < kTagSize; i++) {
+            tag |= static_cast<uint64_t>(static_cast<uint8_t>(key[key.size() - kTagSize + i])) << (8 * i);
+        }
+        return tag;
+    }
+};
+
+// leveldb's internal key order: user keys ascending, then sequence numbers descending. Index separators are left
+// as they are, leveldb's own shortening is not public and a bytewise one would cut into the tag.
+class InternalKeyOrder : public leveldb::Comparator {
+public:
+    auto Name() const -> const char* override { return "leveldb.InternalKeyComparator"; }
+
+    auto Compare(const leveldb::Slice& a, const leveldb::Slice& b) const -> int override {
+        if (const int order = InternalKey::UserKey(a).compare(InternalKey::UserKey(b)); order != 0) return order;
+        const auto tag_a = InternalKey::Tag(a);
+        const auto tag_b = InternalKey::Tag(b);
+        return tag_a > tag_b ? -1 : tag_a < tag_b ? 1 : 0;
+    }
+
+    void FindShortestSeparator(std::string*, const leveldb::Slice&) const override {}
+    void FindShortSuccessor(std::string*) const override {}
+};
+
+// import --direct: records are sorted on disk in runs of bounded size, merged and written straight into the tables
+// of the empty current db, bypassing the log, the memtable and the compactions a batched import goes through.
+// leveldb registers tables it did not write itself only through RepairDB, which puts them all in level 0. The
+// tables do not overlap, so the compactions that follow move them down without rewriting them.
+struct DirectImport {
+    using Clock = std::chrono::steady_clock;
+
+    // Every record gets sequence number 1 and type value
+    static constexpr uint64_t kTag = (uint64_t{1} << 8) | InternalKey::kTypeValue;
+    static constexpr size_t kTagSize = InternalKey::kTagSize;
+
+    struct Settings {
+        RecordFormat format;
+        bool sorted = false;  // Input is already sorted, no runs are written
+        size_t threads = 1;
+        size_t memory = 0;       // Bytes buffered per run
+        size_t table_bytes = 0;  // Target size of one table, before compression
+    };
+
+    struct Totals {
+        uint64_t rows = 0;
+        uint64_t duplicates = 0;  // Keys given more than once, the last value is kept
+        uint64_t runs = 0;
+        uint64_t tables = 0;
+        uint64_t table_bytes = 0;
+    };
+
+    // Builds the filter from the user keys as leveldb's InternalFilterPolicy does, the db looks it up by the same name
+    class UserKeyFilter : public leveldb::FilterPolicy {
+    public:
+        explicit UserKeyFilter(const leveldb::FilterPolicy& user)
+            : user_(user) {}
+
+        auto Name() const -> const char* override { return user_.Name(); }
+
+        void CreateFilter(const leveldb::Slice* keys, int n, std::string* dst) const override {
+            std::vector<leveldb::Slice> user_keys;
+            user_keys.reserve(n);
+            for (int i = 0; i < n; i++) user_keys.push_back(InternalKey::UserKey(keys[i]));
+            user_.CreateFilter(user_keys.data(), n, dst);
+        }
+
+        auto KeyMayMatch(const leveldb::Slice& key, const leveldb::Slice& filter) const -> bool override {
+            return user_.KeyMayMatch(InternalKey::UserKey(key), filter);
+        }
+
+    private:
+        const leveldb::FilterPolicy& user_;
+    };
+
+    // Records of a sort run or a table, back to back in an arena
+    struct Records {
+        // Largest key or value an entry and the header of a run file can hold
+        static constexpr size_t kMaxSize = std::numeric_limits<uint32_t>::max();
+
+        struct Entry {
+            size_t offset;
+            uint32_t key_size;
+            uint32_t value_size;
+        };
+
+        std::string arena;
+        std::vector<Entry> entries;
+
+        void Add(std::string_view key, std::string_view value) {
+            entries.push_back({arena.size(), static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())});
+            arena.append(key);
+            arena.append(value);
+        }
+
+        auto Key(const Entry& entry) const -> std::string_view {
+            return std::string_view(arena).substr(entry.offset, entry.key_size);
+        }
+
+        auto Value(const Entry& entry) const -> std::string_view {
+            return std::string_view(arena).substr(entry.offset + entry.key_size, entry.value_size);
+        }
+
+        auto bytes() const -> size_t { return arena.size() + entries.size() * sizeof(Entry); }
+
+        // Stable, so of equal keys the one given last stays last. Chunks are sorted in parallel and merged pairwise.
+        // Of equal keys only the last is kept.
+        void Sort(size_t threads, uint64_t& duplicates) {
+            const auto less = [&](const Entry& a, const Entry& b) { return Key(a) < Key(b); };
+            const size_t chunks = std::clamp<size_t>(threads, 1, std::max<size_t>(entries.size() / 4096, 1));
+            const auto bound = [&](size_t chunk) { return entries.begin() + entries.size() * chunk / chunks; };
+            ParallelFor(chunks, threads, [&](size_t i) { std::stable_sort(bound(i), bound(i + 1), less); });
+            for (size_t width = 1; width < chunks; width *= 2) {
+                ParallelFor((chunks + 2 * width - 1) / (2 * width), threads, [&](size_t pair) {
+                    const size_t first = pair * 2 * width;
+                    const size_t middle = std::min(first + width, chunks);
+                    const size_t last = std::min(first + 2 * width, chunks);
+                    std::inplace_merge(bound(first), bound(middle), bound(last), less);
+                });
+            }
+
+            size_t kept = 0;
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (i + 1 < entries.size() && Key(entries[i]) == Key(entries[i + 1])) continue;
+                entries[kept++] = entries[i];
+            }
+            duplicates += entries.size() - kept;
+            entries.resize(kept);
+        }
+
+        void Clear() {
+            arena.clear();
+            entries.clear();
+        }
+    };
+
+    // Sequential reader of a run file: fixed32 key size, fixed32 value size, key, value
+    class RunReader {
+    public:
+        explicit RunReader(FilePtr file)
+            : file_(std::move(file)) {}
+
+        // The views stay valid until the next call, false at the end of the run or on a read error
+        auto Next() -> bool {
+            if (!Fill(8)) return false;
+            const auto key_size = Fixed32(buffer_.data() + pos_);
+            const auto value_size = Fixed32(buffer_.data() + pos_ + 4);
+            if (!Fill(8 + size_t{key_size} + value_size)) return false;
+            key_ = std::string_view(buffer_).substr(pos_ + 8, key_size);
+            value_ = std::string_view(buffer_).substr(pos_ + 8 + key_size, value_size);
+            pos_ += 8 + size_t{key_size} + value_size;
+            return true;
+        }
+
+        auto key() const -> std::string_view { return key_; }
+        auto value() const -> std::string_view { return value_; }
+        auto error() const -> bool { return std::ferror(file_.get()) != 0; }
+
+    private:
+        static constexpr size_t kBlock = 1 << 20;
+
+        static auto Fixed32(const char* p) -> uint32_t {
+            uint32_t value = 0;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        auto Fill(size_t n) -> bool {
+            if (end_ - pos_ >= n) return true;
+            std::memmove(buffer_.data(), buffer_.data() + pos_, end_ - pos_);
+            end_ -= pos_;
+            pos_ = 0;
+            if (buffer_.size() < std::max(n, kBlock)) buffer_.resize(std::max(n, kBlock));
+            while (end_ < n) {
+                const size_t read = std::fread(buffer_.data() + end_, 1, buffer_.size() - end_, file_.get());
+                if (read == 0) return false;
+                end_ += read;
+            }
+            return true;
+        }
+
+        FilePtr file_;
+        std::string buffer_;
+        size_t pos_ = 0;
+        size_t end_ = 0;
+        std::string_view key_;
+        std::string_view value_;
+    };
+
+    // Collects the merged records into tables of about table_bytes and builds a wave of one table per thread in
+    // parallel, so at most threads tables are held in memory
+    class TableWriter {
+    public:
+        TableWriter(const Handle& handle, const Settings& settings, Totals& totals)
+            : handle_(handle),
+              settings_(settings),
+              totals_(totals),
+              filter_(handle.filter_policy ? std::make_unique<UserKeyFilter>(*handle.filter_policy) : nullptr) {
+            options_ = handle.options;
+            options_.comparator = &order_;
+            options_.filter_policy = filter_.get();
+        }
+
+        auto Add(std::string_view key, std::string_view value) -> leveldb::Status {
+            if (key.size() + kTagSize > Records::kMaxSize || value.size() > Records::kMaxSize) {
+                return leveldb::Status::InvalidArgument("records of 4 GiB or more are not supported with --direct");
+            }
+            if (wave_.empty() || wave_.back().arena.size() >= settings_.table_bytes) {
+                if (wave_.size() == settings_.threads) {
+                    if (auto status = BuildWave(); !status.ok()) return status;
+                }
+                wave_.emplace_back();
+            }
+            // The tag is part of the stored key, a table's records are its internal keys and values
+            auto& table = wave_.back();
+            table.entries.push_back({table.arena.size(), static_cast<uint32_t>(key.size() + kTagSize),
+                                     static_cast<uint32_t>(value.size())});
+            table.arena.append(key);
+            for (size_t i = 0; i < kTagSize; i++) table.arena.push_back(static_cast<char>(kTag >> (8 * i)));
+            table.arena.append(value);
+            return leveldb::Status::OK();
+        }
+
+        auto Finish() -> leveldb::Status { return BuildWave(); }
+
+    private:
+        auto BuildWave() -> leveldb::Status {
+            FirstError error;
+            std::atomic<uint64_t> bytes = 0;
+            const uint64_t first_number = next_number_;
+            ParallelFor(wave_.size(), settings_.threads, [&](size_t i) {
+                auto size = Build(wave_[i], first_number + i);
+                if (!size) {
+                    error.Set(std::move(size.error()));
+                    return;
+                }
+                bytes += *size;
+            });
+            next_number_ += wave_.size();
+            totals_.tables += wave_.size();
+            totals_.table_bytes += bytes;
+            wave_.clear();
+            return error.failed() ? error.status() : leveldb::Status::OK();
+        }
+
+        auto Build(const Records& records, uint64_t number) const -> std::expected<uint64_t, leveldb::Status> {
+            const auto name = std::format("{}/{:06}.ldb", handle_.path, number);
+            leveldb::WritableFile* raw = nullptr;
+            auto status = leveldb::Env::Default()->NewWritableFile(name, &raw);
+            if (!status.ok()) return std::unexpected(status);
+            const std::unique_ptr<leveldb::WritableFile> file(raw);
+
+            leveldb::TableBuilder builder(options_, file.get());
+            for (const auto& entry : records.entries) {
+                builder.Add(ViewToSlice(records.Key(entry)), ViewToSlice(records.Value(entry)));
+            }
+            status = builder.Finish();
+            if (status.ok()) status = file->Sync();
+            if (status.ok()) status = file->Close();
+            if (!status.ok()) return std::unexpected(status);
+            return builder.FileSize();
+        }
+
+        const Handle& handle_;
+        const Settings& settings_;
+        Totals& totals_;
+        InternalKeyOrder order_;
+        std::unique_ptr<UserKeyFilter> filter_;
+        leveldb::Options options_;
+        std::vector<Records> wave_;
+        uint64_t next_number_ = 1;
+    };
+
+    // Removes the run files however the import ends
+    struct TempDir {
+        fs::path path;
+
+        ~TempDir() {
+            std::error_code ec;
+            fs::remove_all(path, ec);
+        }
+    };
+
+    static void Run(std::FILE* input, const Settings& settings) {
+        if (!CheckEmpty()) return;
+
+        Totals totals;
+        const auto start = Clock::now();
+        if (settings.sorted) {
+            // Streams the input straight into the tables once the db is emptied, order is checked on the way
+            if (!PrepareDb()) return;
+            TableWriter writer(*current, settings, totals);
+            auto status = ReadSorted(input, settings, writer, totals);
+            if (status.ok()) status = writer.Finish();
+            Register(status, totals, start, start);
+            return;
+        }
+
+        TempDir temp{fs::path(current->path + std::format(".repl-import-{}", getpid()))};
+        std::vector<fs::path> runs;
+        Records last;
+        std::error_code ec;
+        fs::create_directories(temp.path, ec);
+        if (ec) {
+            PrintError("import --direct create {} '{}'", temp.path.string(), ec.message());
+            return;
+        }
+        if (!WriteRuns(input, settings, temp.path, runs, last, totals)) return;
+        const auto sorted = Clock::now();
+
+        if (!PrepareDb()) return;
+        TableWriter writer(*current, settings, totals);
+        auto status = Merge(runs, last, writer, totals);
+        if (status.ok()) status = writer.Finish();
+        Register(status, totals, start, sorted);
+    }
+
+private:
+    static auto CheckEmpty() -> bool {
+        if (InBackground()) {
+            PrintError("import --direct closes the database while loading and cannot run in the background");
+            return false;
+        }
+        ReapJobs();
+        if (current->snapshot != nullptr ||
+            std::ranges::any_of(jobs, [](const auto& job) { return job->handle == current; })) {
+            PrintError("import --direct needs the snapshot released and the background jobs of the db finished");
+            return false;
+        }
+        auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator({}));
+        it->SeekToFirst();
+        if (it->Valid() || !it->status().ok()) {
+            PrintError("import --direct loads into an empty database only, {} has data", current->path);
+            return false;
+        }
+        return true;
+    }
+
+    // Deletes the empty db so the directory holds nothing but the new tables when RepairDB looks at it. On failure
+    // the db is opened again as it was.
+    static auto PrepareDb() -> bool {
+        current->db.reset();
+        auto status = leveldb::DestroyDB(current->path, current->options);
+        std::error_code ec;
+        if (status.ok() && !fs::create_directories(current->path, ec) && ec) {
+            status = leveldb::Status::IOError(current->path, ec.message());
+        }
+        if (status.ok()) return true;
+        PrintError("import --direct reset {} status='{}'", current->path, status.ToString());
+        Reopen();
+        return false;
+    }
+
+    // Without a db the handle would be left unusable, so it is closed when the db does not open again
+    static void Reopen() {
+        const auto status = leveldb::DB::Open(current->options, current->path, std::out_ptr(current->db));
+        if (status.ok()) return;
+        PrintError("reopen {} status='{}', closing {}", current->path, status.ToString(), current->name);
+        CloseHandle(*current);
+    }
+
+    static auto ReadSorted(std::FILE* input, const Settings& settings, TableWriter& writer, Totals& totals)
+        -> leveldb::Status {
+        LineReader reader(input);
+        RecordParser parser(settings.format);
+        const char quote = settings.format == RecordFormat::csv ? '"' : '\0';
+        JobTicker ticker;
+
+        // Each record is held back until the next one shows it is not overwritten by a duplicate
+        std::string key;
+        std::string value;
+        bool held = false;
+        uint64_t line_no = 0;
+        while (auto line = reader.Next(quote)) {
+            line_no++;
+            if (line->empty()) continue;
+            if (!ticker.Tick(line->size())) return Cancelled();
+            auto record = parser.Parse(*line);
+            if (!record) {
+                return leveldb::Status::InvalidArgument(std::format("line {}", line_no), ViewToSlice(record.error()));
+            }
+
+            if (held && record->key < std::string_view(key)) {
+                return leveldb::Status::InvalidArgument(std::format("line {}", line_no), "input is not sorted by key");
+            }
+            if (held && record->key == std::string_view(key)) {
+                totals.duplicates++;
+            } else if (held) {
+                if (auto status = writer.Add(key, value); !status.ok()) return status;
+                totals.rows++;
+            }
+            key.assign(record->key);
+            value.assign(record->value);
+            held = true;
+        }
+        if (reader.error()) return leveldb::Status::IOError("read", std::strerror(errno));
+        if (!held) return leveldb::Status::OK();
+        totals.rows++;
+        return writer.Add(key, value);
+    }
+
+    // Sorted runs of at most settings.memory bytes, the last one stays in memory for the merge
+    static auto WriteRuns(std::FILE* input,
+                          const Settings& settings,
+                          const fs::path& dir,
+                          std::vector<fs::path>& runs,
+                          Records& run,
+                          Totals& totals) -> bool {
+        LineReader reader(input);
+        RecordParser parser(settings.format);
+        const char quote = settings.format == RecordFormat::csv ? '"' : '\0';
+        JobTicker ticker;
+
+        uint64_t line_no = 0;
+        while (auto line = reader.Next(quote)) {
+            line_no++;
+            if (line->empty()) continue;
+            if (!ticker.Tick(line->size())) {
+                PrintError("import status='{}'", Cancelled().ToString());
+                return false;
+            }
+            auto record = parser.Parse(*line);
+            if (!record) {
+                PrintError("import line {}: {}", line_no, record.error());
+                return false;
+            }
+            if (record->key.size() > Records::kMaxSize || record->value.size() > Records::kMaxSize) {
+                PrintError("import line {}: records of 4 GiB or more are not supported with --direct", line_no);
+                return false;
+            }
+            run.Add(record->key, record->value);
+            if (run.bytes() < settings.memory) continue;
+
+            run.Sort(settings.threads, totals.duplicates);
+            auto path = dir / std::format("run-{}", runs.size());
+            if (!WriteRun(run, path)) return false;
+            runs.push_back(std::move(path));
+            run.Clear();
+        }
+        if (reader.error()) {
+            PrintError("import read failed '{}'", std::strerror(errno));
+            return false;
+        }
+        run.Sort(settings.threads, totals.duplicates);
+        totals.runs = runs.size() + 1;
+        return true;
+    }
+
+    static auto WriteRun(const Records& run, const fs::path& path) -> bool {
+        FilePtr file(std::fopen(path.c_str(), "wb"), &std::fclose);
+        if (file == nullptr) {
+            PrintError("import --direct {} '{}'", path.string(), std::strerror(errno));
+            return false;
+        }
+        OutputBuffer out(file.get());
+        for (const auto& entry : run.entries) {
+            char header[8];
+            std::memcpy(header, &entry.key_size, 4);
+            std::memcpy(header + 4, &entry.value_size, 4);
+            out.Append(std::string_view(header, sizeof(header)));
+            out.Append(run.Key(entry));
+            out.Append(run.Value(entry));
+        }
+        if (!out.Flush() || std::fflush(file.get()) != 0) {
+            PrintError("import --direct write {} failed '{}'", path.string(), std::strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // k-way merge of the run files and the in-memory run, each sorted without duplicates. Of keys in several runs
+    // the one from the latest run, the one given last, wins.
+    static auto Merge(const std::vector<fs::path>& paths, const Records& last, TableWriter& writer, Totals& totals)
+        -> leveldb::Status {
+        std::vector<RunReader> readers;
+        readers.reserve(paths.size());
+        for (const auto& path : paths) {
+            FilePtr file(std::fopen(path.c_str(), "rb"), &std::fclose);
+            if (file == nullptr) return leveldb::Status::IOError(path.string(), std::strerror(errno));
+            readers.emplace_back(std::move(file));
+        }
+
+        // Source readers.size() is the in-memory run
+        size_t last_pos = 0;
+        const auto key_of = [&](size_t source) {
+            return source == readers.size() ? last.Key(last.entries[last_pos]) : readers[source].key();
+        };
+        const auto value_of = [&](size_t source) {
+            return source == readers.size() ? last.Value(last.entries[last_pos]) : readers[source].value();
+        };
+        const auto advance = [&](size_t source) -> bool {
+            if (source == readers.size()) return ++last_pos < last.entries.size();
+            return readers[source].Next();
+        };
+
+        // A min-heap on the key, among equal keys the latest source comes out first
+        const auto after = [&](size_t a, size_t b) {
+            const int order = key_of(a).compare(key_of(b));
+            return order != 0 ? order > 0 : a < b;
+        };
+        std::vector<size_t> heap;
+        for (size_t source = 0; source < readers.size(); source++) {
+            if (readers[source].Next()) heap.push_back(source);
+        }
+        if (!last.entries.empty()) heap.push_back(readers.size());
+        std::ranges::make_heap(heap, after);
+
+        JobTicker ticker;
+        std::string previous;
+        while (!heap.empty()) {
+            std::ranges::pop_heap(heap, after);
+            const auto source = heap.back();
+            const auto key = key_of(source);
+            const auto value = value_of(source);
+            if (!ticker.Tick(key.size() + value.size())) return Cancelled();
+
+            if (totals.rows != 0 && key == std::string_view(previous)) {
+                totals.duplicates++;
+            } else {
+                if (auto status = writer.Add(key, value); !status.ok()) return status;
+                previous.assign(key);
+                totals.rows++;
+            }
+
+            if (advance(source)) {
+                std::ranges::push_heap(heap, after);
+            } else {
+                heap.pop_back();
+            }
+        }
+        for (const auto& reader : readers) {
+            if (reader.error()) return leveldb::Status::IOError("read run failed", std::strerror(errno));
+        }
+        return leveldb::Status::OK();
+    }
+
+    // Lets RepairDB write a MANIFEST for the new tables and opens the db again, on failure it is left empty
+    static void Register(leveldb::Status status, const Totals& totals, Clock::time_point start,
+                         Clock::time_point sorted) {
+        if (status.ok()) status = leveldb::RepairDB(current->path, current->options);
+        if (status.ok()) status = leveldb::DB::Open(current->options, current->path, std::out_ptr(current->db));
+        if (!status.ok()) {
+            PrintError("import --direct status='{}'", status.ToString());
+            current->db.reset();
+            if (auto destroyed = leveldb::DestroyDB(current->path, current->options); !destroyed.ok()) {
+                PrintError("import --direct remove the partial import status='{}'", destroyed.ToString());
+            }
+            Reopen();
+            return;
+        }
+
+        const auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        println("OK imported {} rows into {} tables ({:.1f} MB) in {:.2f}s ({:.0f} rows/s)",
+                totals.rows,
+                totals.tables,
+                static_cast<double>(totals.table_bytes) / (1 << 20),
+                seconds,
+                seconds > 0 ? static_cast<double>(totals.rows) / seconds : 0.0);
+        if (totals.runs != 0) {
+            println("sorted in {} runs in {:.2f}s", totals.runs, std::chrono::duration<double>(sorted - start).count());
+        }
+        if (totals.duplicates != 0) {
+            println("{} keys were given more than once, the last value was kept", totals.duplicates);
+        }
+    }
+};
+
+struct ImportFunctor {
+    static constexpr size_t kDefaultBatchOps = 10000;
+    static constexpr size_t kDefaultBatchBytes = 4 << 20;
+    static constexpr size_t kDefaultMemoryMb = 256;
+    static constexpr size_t kDefaultTableMb = 32;
+
+    void operator()(const ArgsVector& args) const {
+        if (current->pending_batch) {
+            PrintError("import not allowed while a batch is in progress");
+            return;
+        }
+
+        auto cmd = ParseCommandArgs(args,
+                                    {"--direct", "--sorted"},
+                                    {"--format",
+                                     "--batch-ops",
+                                     "--batch-bytes",
+                                     "--threads",
+                                     "--memory-mb",
+                                     "--table-mb"});
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("import expected a path or - for stdin");
+            return;
+        }
+
+        const auto path = cmd->positional[0];
+        auto format = ResolveFormat(path, cmd->Get("--format"));
+        auto batch_ops = cmd->GetNumber<size_t>("--batch-ops", kDefaultBatchOps);
+        auto batch_bytes = cmd->GetNumber<size_t>("--batch-bytes", kDefaultBatchBytes);
+        if (!format || !batch_ops || !batch_bytes) return;
+        const bool direct = cmd->Has("--direct");
+        if (cmd->Has("--sorted") && !direct) {
+            PrintError("import --sorted applies to --direct only");
+            return;
+        }
+        auto threads = cmd->GetNumber<size_t>("--threads", DefaultThreads());
+        auto memory_mb = cmd->GetNumber<size_t>("--memory-mb", kDefaultMemoryMb);
+        auto table_mb = cmd->GetNumber<size_t>("--table-mb", kDefaultTableMb);
+        if (!threads || !memory_mb || !table_mb) return;
+
+        FilePtr owned{nullptr, &std::fclose};
+        std::FILE* file = stdin;
+        if (path != "-") {
+            owned.reset(std::fopen(std::string(path).c_str(), "rb"));
+            if (owned == nullptr) {
+                PrintError("import {} '{}'", path, std::strerror(errno));
+                return;
+            }
+            file = owned.get();
+            posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        if (direct) {
+            DirectImport::Run(file,
+                              {.format = *format,
+                               .sorted = cmd->Has("--sorted"),
+                               .threads = std::max<size_t>(1, *threads),
+                               .memory = std::max<size_t>(1, *memory_mb) << 20,
+                               .table_bytes = std::max<size_t>(1, *table_mb) << 20});
+            return;
+        }
+        Run(file, *format, *batch_ops, *batch_bytes);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static auto ResolveFormat(std::string_view path, std::optional<std::string_view> name)
+        -> std::optional<RecordFormat> {
+        if (name) {
+            auto format = enchantum::cast<RecordFormat>(*name);
+            if (!format || *format == RecordFormat::text) {
+                PrintError("import unknown format '{}' expected csv|tsv|ndjson", *name);
+                return std::nullopt;
+            }
+            return format;
+        }
+        if (path.ends_with(".tsv")) return RecordFormat::tsv;
+        if (path.ends_with(".ndjson") || path.ends_with(".jsonl")) return RecordFormat::ndjson;
+        return RecordFormat::csv;
+    }
+
+    static void Run(std::FILE* file, RecordFormat format, size_t batch_ops, size_t batch_bytes) {
+        LineReader reader(file);
+        RecordParser parser(format);
+        leveldb::WriteBatch batch;
+        size_t batch_count = 0;
+        uint64_t rows = 0;
+        uint64_t line_no = 0;
+
+        const auto start = Clock::now();
+        auto next_report = start + std::chrono::seconds(1);
+        const char quote = format == RecordFormat::csv ? '"' : '\0';
+
+        auto flush = [&]() {
+            const auto status = current->db->Write(durability.NextWrite(batch_count), &batch);
+            batch.Clear();
+            batch_count = 0;
+            if (!status.ok()) {
+                PrintError("import write status='{}'", status.ToString());
+            }
+            return status.ok();
+        };
+        // Keeps the records read before an error and reports how many were written
+        auto stop = [&]() {
+            const auto pending = batch_count;
+            if (pending != 0 && flush()) rows += pending;
+            println("imported {} rows before the error", rows);
+        };
+
+        JobTicker ticker;
+        while (auto line = reader.Next(quote)) {
+            line_no++;
+            if (line->empty()) continue;
+            if (!ticker.Tick(line->size())) {
+                PrintError("import status='{}'", Cancelled().ToString());
+                stop();
+                return;
+            }
+
+            auto record = parser.Parse(*line);
+            if (!record) {
+                PrintError("import line {}: {}", line_no, record.error());
+                stop();
+                return;
+            }
+
+            batch.Put(ViewToSlice(record->key), ViewToSlice(record->value));
+            batch_count++;
+            if (batch_count < batch_ops && batch.ApproximateSize() < batch_bytes) continue;
+
+            rows += batch_count;
+            if (!flush()) return;
+
+            if (const auto now = Clock::now(); now >= next_report && !InBackground()) {
+                PrintProgress("imported", rows, reader.bytes_read(), now - start);
+                next_report = now + std::chrono::seconds(1);
+            }
+        }
+
+        if (reader.error()) {
+            PrintError("import read failed '{}'", std::strerror(errno));
+            stop();
+            return;
+        }
+
+        rows += batch_count;
+        if (batch_count != 0 && !flush()) return;
+        PrintProgress("OK imported", rows, reader.bytes_read(), Clock::now() - start);
+    }
+
+    static void PrintProgress(std::string_view what, uint64_t rows, uint64_t bytes, Clock::duration elapsed) {
+        const auto seconds = std::chrono::duration<double>(elapsed).count();
+        println("{} {} rows, {:.1f} MB in {:.2f}s ({:.0f} rows/s)",
+                what,
+                rows,
+                static_cast<double>(bytes) / (1 << 20),
+                seconds,
+                seconds > 0 ? static_cast<double>(rows) / seconds : 0.0);
+    }
+};
+
+struct ExportFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {}, {"--format", "--threads"});
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("export expected a path or - for stdout");
+            return;
+        }
+
+        const auto path = cmd->positional[0];
+        auto format = ResolveFormat(path, cmd->Get("--format"));
+        auto threads = cmd->GetNumber<size_t>("--threads", 1);
+        if (!format || !threads) return;
+        if (*threads > 1 && path == "-") {
+            PrintError("export --threads requires a file path");
+            return;
+        }
+
+        FilePtr owned{nullptr, &std::fclose};
+        std::FILE* file = stdout;
+        if (path != "-") {
+            owned.reset(std::fopen(std::string(path).c_str(), "wb"));
+            if (owned == nullptr) {
+                PrintError("export {} '{}'", path, std::strerror(errno));
+                return;
+            }
+            file = owned.get();
+        }
+
+        Run(path, file, *format, *threads);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Totals {
+        std::atomic<uint64_t> rows = 0;
+        std::atomic<uint64_t> bytes = 0;
+    };
+
+    static auto ResolveFormat(std::string_view path, std::optional<std::string_view> name)
+        -> std::optional<RecordFormat> {
+        if (name) {
+            auto format = enchantum::cast<RecordFormat>(*name);
+            if (!format) PrintError("export unknown format '{}' expected text|csv|tsv|ndjson", *name);
+            return format;
+        }
+        if (path.ends_with(".csv")) return RecordFormat::csv;
+        if (path.ends_with(".tsv")) return RecordFormat::tsv;
+        if (path.ends_with(".ndjson") || path.ends_with(".jsonl")) return RecordFormat::ndjson;
+        return RecordFormat::text;
+    }
+
+    // With several threads the keyspace is split into ranges. The first range streams straight into the destination,
+    // the others into temporary files next to it that are appended in key order once all ranges are done.
+    static void Run(std::string_view path, std::FILE* file, RecordFormat format, size_t threads) {
+        ScopedSnapshot snapshot(*current);
+        leveldb::ReadOptions opts{};
+        opts.fill_cache = false;
+        opts.snapshot = snapshot.get();
+
+        const auto start = Clock::now();
+        const auto parts = SplitRange(*current, KeyRange{}, threads > 1 ? threads * 4 : 1);
+        std::vector<std::string> part_paths(parts.size());
+        Totals totals;
+        FirstError error;
+        ParallelFor(parts.size(), threads, [&](size_t i) {
+            if (error.failed()) return;
+            FilePtr part{nullptr, &std::fclose};
+            std::FILE* dest = file;
+            if (i != 0) {
+                part_paths[i] = std::format("{}.part{}", path, i);
+                part.reset(std::fopen(part_paths[i].c_str(), "wb"));
+                if (part == nullptr) {
+                    error.Set(leveldb::Status::IOError(part_paths[i], std::strerror(errno)));
+                    return;
+                }
+                dest = part.get();
+            }
+            auto status = ExportRange(dest, format, opts, parts[i], totals);
+            if (!status.ok()) error.Set(std::move(status));
+        });
+
+        for (size_t i = 1; i < parts.size() && !error.failed(); i++) {
+            if (auto status = AppendFile(file, part_paths[i]); !status.ok()) error.Set(std::move(status));
+        }
+        for (const auto& part_path : part_paths) {
+            if (!part_path.empty()) std::remove(part_path.c_str());
+        }
+
+        if (error.failed()) {
+            PrintError("export status='{}'", error.status().ToString());
+            return;
+        }
+        if (path == "-") return;
+
+        const auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        println("OK exported {} rows, {:.1f} MB in {:.2f}s ({:.0f} rows/s)", totals.rows.load(),
+                static_cast<double>(totals.bytes) / (1 << 20), seconds,
+                seconds > 0 ? static_cast<double>(totals.rows) / seconds : 0.0);
+    }
+
+    static auto ExportRange(std::FILE* file,
+                            RecordFormat format,
+                            const leveldb::ReadOptions& opts,
+                            const KeyRange& range,
+                            Totals& totals) -> leveldb::Status {
+        auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(opts));
+        OutputBuffer out(file);
+        uint64_t rows = 0;
+        auto status = ScanRange(*it, range, false, [&](leveldb::Iterator& row) {
+            AppendRecord(out, format, SliceToView(row.key()), SliceToView(row.value()));
+            rows++;
+            return !out.failed();
+        });
+
+        const bool written = out.Flush();
+        totals.rows += rows;
+        totals.bytes += out.bytes_written();
+        if (!written) return leveldb::Status::IOError("write failed", std::strerror(errno));
+        return status;
+    }
+
+    static auto AppendFile(std::FILE* file, const std::string& path) -> leveldb::Status {
+        FilePtr part(std::fopen(path.c_str(), "rb"), &std::fclose);
+        if (part == nullptr) return leveldb::Status::IOError(path, std::strerror(errno));
+
+        std::vector<char> buffer(OutputBuffer::kCapacity);
+        while (const size_t n = std::fread(buffer.data(), 1, buffer.size(), part.get())) {
+            if (std::fwrite(buffer.data(), 1, n, file) != n) return leveldb::Status::IOError("write failed");
+        }
+        if (std::ferror(part.get())) return leveldb::Status::IOError(path, std::strerror(errno));
+        return leveldb::Status::OK();
+    }
+};
+
+// Row filter of scan and prefix --where, compiled once and run against the stored bytes, before any decoding:
+//   key|value contains <text>     substring search with memmem, vectorized in glibc and musl
+//   key|value matches /<re>/[i]   ECMAScript regex searched anywhere in the bytes
+//   len(key|value) <op> <n>       op one of < <= > >= == !=
+class Predicate {
+public:
+    static auto Compile(std::string_view text) -> std::expected<Predicate, std::string> {
+        Predicate predicate;
+        const auto space = std::min(text.find(' '), text.size());
+        auto subject = text.substr(0, space);
+        auto rest = text.substr(std::min(space + 1, text.size()));
+
+        const bool length = subject.starts_with("len(") && subject.ends_with(')');
+        if (length) subject = subject.substr(4, subject.size() - 5);
+        if (subject != "key" && subject != "value") {
+            return std::unexpected(std::format("'{}' expected key, value, len(key) or len(value)", text));
+        }
+        predicate.on_value_ = subject == "value";
+
+        const auto op_end = std::min(rest.find(' '), rest.size());
+        const auto op = rest.substr(0, op_end);
+        const auto operand = rest.substr(std::min(op_end + 1, rest.size()));
+        if (length) {
+            static constexpr std::array<std::string_view, 6> kOps = {"<", "<=", ">", ">=", "==", "!="};
+            const auto found = std::ranges::find(kOps, op);
+            if (found == kOps.end()) return std::unexpected(std::format("'{}' expected one of < <= > >= == !=", op));
+            const auto [ptr, ec] = std::from_chars(operand.data(), operand.data() + operand.size(), predicate.length_);
+            if (ec != std::errc() || ptr != operand.data() + operand.size()) {
+                return std::unexpected(std::format("'{}' is not a length", operand));
+            }
+            predicate.kind_ = static_cast<Kind>(static_cast<size_t>(Kind::less) + (found - kOps.begin()));
+            return predicate;
+        }
+
+        if (op == "contains") {
+            if (operand.empty()) return std::unexpected(std::string("contains expected text"));
+            predicate.kind_ = Kind::contains;
+            predicate.needle_ = operand;
+            return predicate;
+        }
+        if (op == "matches") {
+            const auto close = operand.rfind('/');
+            if (!operand.starts_with('/') || close == 0 || close == std::string_view::npos) {
+                return std::unexpected(std::format("'{}' expected /regex/", operand));
+            }
+            const auto flags = operand.substr(close + 1);
+            if (flags != "" && flags != "i") return std::unexpected(std::format("'{}' unknown regex flags", flags));
+            auto syntax = std::regex::ECMAScript | std::regex::optimize;
+            if (flags == "i") syntax |= std::regex::icase;
+            try {
+                predicate.regex_.emplace(operand.begin() + 1, operand.begin() + close, syntax);
+            } catch (const std::regex_error& e) {
+                return std::unexpected(std::format("'{}' {}", operand, e.what()));
+            }
+            predicate.kind_ = Kind::matches;
+            return predicate;
+        }
+        return std::unexpected(std::format("'{}' expected contains or matches", op));
+    }
+
+    // Keys only scans skip loading values when the predicate does not look at them
+    auto on_value() const -> bool { return on_value_; }
+
+    auto Matches(std::string_view key, std::string_view value) const -> bool {
+        const auto bytes = on_value_ ? value : key;
+        switch (kind_) {
+            case Kind::contains:
+                return memmem(bytes.data(), bytes.size(), needle_.data(), needle_.size()) != nullptr;
+            case Kind::matches:
+                return std::regex_search(bytes.data(), bytes.data() + bytes.size(), *regex_);
+            case Kind::less:
+                return bytes.size() < length_;
+            case Kind::less_equal:
+                return bytes.size() <= length_;
+            case Kind::greater:
+                return bytes.size() > length_;
+            case Kind::greater_equal:
+                return bytes.size() >= length_;
+            case Kind::equal:
+                return bytes.size() == length_;
+            case Kind::not_equal:
+                return bytes.size() != length_;
+        }
+        return false;
+    }
+
+private:
+    // The length comparisons are in the order of the operators in Compile
+    enum class Kind : uint8_t { contains, matches, less, less_equal, greater, greater_equal, equal, not_equal };
+
+    Kind kind_ = Kind::contains;
+    bool on_value_ = false;
+    std::string needle_;
+    std::optional<std::regex> regex_;
+    uint64_t length_ = 0;
+};
+
+// Shared by scan and prefix: walks a range and prints rows, keys or only the number of matches
+struct RangeQuery {
+    static auto Parse(const ArgsVector& args) -> std::optional<CommandArgs> {
+        return ParseCommandArgs(args, {"--reverse", "--keys-only", "--count"}, {"--limit", "--where"});
+    }
+
+    static void Run(std::string_view name, const CommandArgs& cmd, const KeyRange& range) {
+        auto limit = cmd.GetNumber<uint64_t>("--limit", 0);
+        if (!limit) return;
+        const bool keys_only = cmd.Has("--keys-only");
+        const bool count_only = cmd.Has("--count");
+        std::optional<Predicate> where;
+        if (auto text = cmd.Get("--where")) {
+            auto compiled = Predicate::Compile(*text);
+            if (!compiled) {
+                PrintError("{} --where {}", name, compiled.error());
+                return;
+            }
+            where = std::move(*compiled);
+        }
+
+        auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(SessionReadOptions()));
+        OutputBuffer out(stdout);
+        uint64_t rows = 0;
+        const auto status = ScanRange(*it, range, cmd.Has("--reverse"), [&](leveldb::Iterator& row) {
+            if (where) {
+                const auto value = where->on_value() ? SliceToView(row.value()) : std::string_view();
+                if (!where->Matches(SliceToView(row.key()), value)) return true;
+            }
+            if (count_only) {
+                // Nothing to print, the value is never looked at
+            } else if (keys_only) {
+                AppendDisplayKey(out, SliceToView(row.key()));
+                out.Append('\n');
+            } else {
+                AppendDisplayRecord(out, SliceToView(row.key()), SliceToView(row.value()));
+            }
+            return ++rows != *limit;
+        });
+        out.Flush();
+
+        if (!status.ok()) {
+            PrintError("{} status='{}'", name, status.ToString());
+            return;
+        }
+        if (count_only) println("{}", rows);
+    }
+};
+
+struct ScanFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = RangeQuery::Parse(args);
+        if (!cmd) return;
+        if (cmd->positional.empty() || cmd->positional.size() > 2) {
+            PrintError("scan expected <start> [end]");
+            return;
+        }
+
+        std::string scratch;
+        const auto start = EncodeArgument(key_codec, cmd->positional[0], scratch, "scan start");
+        if (!start) return;
+        KeyRange range{std::string(*start), std::nullopt};
+        if (cmd->positional.size() == 2) {
+            const auto end = EncodeArgument(key_codec, cmd->positional[1], scratch, "scan end");
+            if (!end) return;
+            range.end = std::string(*end);
+        }
+        RangeQuery::Run("scan", *cmd, range);
+    }
+};
+
+struct PrefixFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = RangeQuery::Parse(args);
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("prefix expected <prefix>");
+            return;
+        }
+        std::string scratch;
+        const auto prefix = EncodeArgument(key_codec, cmd->positional[0], scratch, "prefix");
+        if (!prefix) return;
+        RangeQuery::Run("prefix", *cmd, KeyRange::Prefix(*prefix));
+    }
+};
+
+// db_bench style workloads against the open database. Keys are 16 digit zero padded numbers as in db_bench and
+// writes go out unsynced, independent of the session sync policy.
+struct BenchFunctor {
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t kKeySize = 16;
+
+    struct Result {
+        Histogram latency;
+        uint64_t bytes = 0;
+        uint64_t found = 0;
+    };
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {}, {"--num", "--value-size", "--threads"});
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("bench expected one benchmark name");
+            return;
+        }
+
+        auto benchmark = enchantum::cast<Benchmark>(cmd->positional[0]);
+        if (!benchmark) {
+            PrintError("bench unknown benchmark '{}'", cmd->positional[0]);
+            return;
+        }
+        const bool writes = *benchmark == Benchmark::fillseq || *benchmark == Benchmark::fillrandom ||
+                            *benchmark == Benchmark::deleterandom;
+        if (writes && current->read_only) {
+            PrintError("bench {} not allowed on a read-only copy", cmd->positional[0]);
+            return;
+        }
+        auto num = cmd->GetNumber<uint64_t>("--num", 100000);
+        auto value_size = cmd->GetNumber<size_t>("--value-size", 100);
+        auto threads = cmd->GetNumber<size_t>("--threads", 1);
+        if (!num || !value_size || !threads) return;
+        if (*num == 0 || *threads == 0) {
+            PrintError("bench --num and --threads must be greater than 0");
+            return;
+        }
+
+        // Values are windows into one random buffer so generating them costs nothing per op
+        std::string values((1 << 20) + *value_size, '\0');
+        std::mt19937_64 rng(301);
+        std::ranges::generate(values, [&] { return static_cast<char>(' ' + rng() % 95); });
+
+        std::vector<Result> results(*threads);
+        const auto start = Clock::now();
+        {
+            std::vector<std::jthread> workers;
+            for (size_t t = 0; t < *threads; t++) {
+                const uint64_t ops = *num / *threads + (t < *num % *threads ? 1 : 0);
+                const uint64_t first = t * (*num / *threads) + std::min<uint64_t>(t, *num % *threads);
+                workers.emplace_back([&, t, ops, first, handle = current, job = current_job] {
+                    current = handle;
+                    current_job = job;
+                    Run(*benchmark, {.first = first, .ops = ops, .num = *num, .seed = t}, values, *value_size,
+                        results[t]);
+                });
+            }
+        }
+        const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        Result total;
+        for (const auto& result : results) {
+            total.latency.Merge(result.latency);
+            total.bytes += result.bytes;
+            total.found += result.found;
+        }
+        Report(*benchmark, total, elapsed, *threads);
+        if (current_job != nullptr && current_job->cancel) PrintError("bench status='{}'", Cancelled().ToString());
+    }
+
+private:
+    struct Partition {
+        uint64_t first;  // First key of this thread for sequential workloads
+        uint64_t ops;
+        uint64_t num;  // Key space size for random workloads
+        uint64_t seed;
+    };
+
+    static void FormatKey(uint64_t index, char (&key)[kKeySize]) {
+        std::ranges::fill(key, '0');
+        char digits[20];
+        const auto [end, ec] = std::to_chars(std::begin(digits), std::end(digits), index);
+        const size_t length = std::min<size_t>(end - digits, kKeySize);
+        std::memcpy(key + kKeySize - length, end - length, length);
+    }
+
+    static void Run(Benchmark benchmark,
+                    const Partition& part,
+                    const std::string& values,
+                    size_t value_size,
+                    Result& result) {
+        std::mt19937_64 rng(part.seed + 1);
+        std::uniform_int_distribution<uint64_t> random_key(0, part.num - 1);
+        std::uniform_int_distribution<size_t> random_offset(0, values.size() - value_size);
+        char key[kKeySize];
+        const auto key_slice = leveldb::Slice(key, kKeySize);
+        std::string value;
+        const leveldb::WriteOptions write_opts{};
+        const leveldb::ReadOptions read_opts{};
+
+        std::unique_ptr<leveldb::Iterator> it;
+        if (benchmark == Benchmark::readseq || benchmark == Benchmark::seekrandom) {
+            it.reset(current->db->NewIterator(read_opts));
+            if (benchmark == Benchmark::readseq) it->SeekToFirst();
+        }
+
+        // Cancellation is polled outside the timed part of each op, a cancelled run reports the ops it got through
+        JobTicker ticker;
+        for (uint64_t i = 0; i < part.ops && ticker.Tick(0); i++) {
+            FormatKey(benchmark == Benchmark::fillseq ? part.first + i : random_key(rng), key);
+            const auto op_start = Clock::now();
+            switch (benchmark) {
+                case Benchmark::fillseq:
+                case Benchmark::fillrandom: {
+                    const auto data = leveldb::Slice(values.data() + random_offset(rng), value_size);
+                    current->db->Put(write_opts, key_slice, data);
+                    result.bytes += kKeySize + value_size;
+                    break;
+                }
+                case Benchmark::readrandom:
+                    if (current->db->Get(read_opts, key_slice, &value).ok()) {
+                        result.found++;
+                        result.bytes += kKeySize + value.size();
+                    }
+                    break;
+                case Benchmark::readseq:
+                    if (!it->Valid()) {
+                        i = part.ops;
+                        continue;
+                    }
+                    result.found++;
+                    result.bytes += it->key().size() + it->value().size();
+                    it->Next();
+                    break;
+                case Benchmark::deleterandom:
+                    current->db->Delete(write_opts, key_slice);
+                    break;
+                case Benchmark::seekrandom:
+                    it->Seek(key_slice);
+                    if (it->Valid() && it->key() == key_slice) result.found++;
+                    break;
+            }
+            const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - op_start);
+            result.latency.Record(nanos.count());
+        }
+    }
+
+    static void Report(Benchmark benchmark, const Result& result, double seconds, size_t threads) {
+        const auto ops = static_cast<double>(result.latency.count());
+        const auto micros = [](uint64_t nanos) { return static_cast<double>(nanos) / 1000.0; };
+
+        print("{:<12} : {:.3f} micros/op; {:.0f} ops/sec;",
+              enchantum::to_string(benchmark),
+              seconds * 1e6 * static_cast<double>(threads) / std::max(ops, 1.0),
+              ops / seconds);
+        if (result.bytes != 0) print(" {:.1f} MB/s;", static_cast<double>(result.bytes) / (1 << 20) / seconds);
+        println(" {} ops, {} threads", result.latency.count(), threads);
+
+        if (benchmark == Benchmark::readrandom || benchmark == Benchmark::seekrandom) {
+            println("found {} of {}", result.found, result.latency.count());
+        }
+        println("latency (us): mean {:.3f} p50 {:.3f} p99 {:.3f} p999 {:.3f} max {:.3f}",
+                result.latency.Mean() / 1000.0, micros(result.latency.Percentile(50)),
+                micros(result.latency.Percentile(99)), micros(result.latency.Percentile(99.9)),
+                micros(result.latency.max()));
+    }
+};
+
+// Looks up many keys in sorted order under one snapshot and prints them in the order they were given
+struct MultiGetFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {}, {"--file", "--threads"});
+        if (!cmd) return;
+        auto threads = cmd->GetNumber<size_t>("--threads", DefaultThreads());
+        if (!threads) return;
+
+        // Keys from the file are stored back to back in one buffer
+        std::string file_keys;
+        std::vector<std::pair<size_t, size_t>> file_key_spans;
+        if (auto path = cmd->Get("--file"); path && !ReadKeys(*path, file_keys, file_key_spans)) return;
+
+        std::vector<std::string_view> keys;
+        keys.reserve(file_key_spans.size() + cmd->positional.size());
+        for (const auto& [offset, length] : file_key_spans) {
+            keys.push_back(std::string_view(file_keys).substr(offset, length));
+        }
+        keys.insert(keys.end(), cmd->positional.begin(), cmd->positional.end());
+        if (keys.empty()) {
+            PrintError("mget expected keys or --file");
+            return;
+        }
+
+        // With a key codec the stored keys are encoded into a second buffer and looked up from there
+        std::string encoded_keys;
+        if (key_codec.codec != Codec::raw) {
+            std::vector<std::pair<size_t, size_t>> spans;
+            std::string scratch;
+            for (const auto key : keys) {
+                const auto encoded = EncodeArgument(key_codec, key, scratch, "mget key");
+                if (!encoded) return;
+                spans.emplace_back(encoded_keys.size(), encoded->size());
+                encoded_keys.append(*encoded);
+            }
+            for (size_t i = 0; i < keys.size(); i++) {
+                keys[i] = std::string_view(encoded_keys).substr(spans[i].first, spans[i].second);
+            }
+        }
+
+        Lookup(keys, *threads);
+    }
+
+private:
+    // Sorted keys are handed to workers in chunks of this size, smaller lookups stay on one thread
+    static constexpr size_t kChunkSize = 1024;
+
+    struct Result {
+        uint32_t chunk = 0;
+        size_t offset = 0;
+        size_t length = 0;
+        bool found = false;
+    };
+
+    static auto ReadKeys(std::string_view path, std::string& keys, std::vector<std::pair<size_t, size_t>>& spans)
+        -> bool {
+        FilePtr file(std::fopen(std::string(path).c_str(), "rb"), &std::fclose);
+        if (file == nullptr) {
+            PrintError("mget {} '{}'", path, std::strerror(errno));
+            return false;
+        }
+
+        LineReader reader(file.get());
+        while (auto line = reader.Next()) {
+            if (line->empty()) continue;
+            spans.emplace_back(keys.size(), line->size());
+            keys.append(*line);
+        }
+        if (reader.error()) {
+            PrintError("mget read {} failed '{}'", path, std::strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    static void Lookup(const std::vector<std::string_view>& keys, size_t threads) {
+        std::vector<uint32_t> order(keys.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::ranges::sort(order, {}, [&](uint32_t i) { return keys[i]; });
+
+        ScopedSnapshot snapshot(*current);
+        leveldb::ReadOptions opts{};
+        opts.snapshot = snapshot.get();
+
+        // Each chunk appends its values to its own arena so printing in the original order needs no per-key allocation
+        const size_t chunks = (keys.size() + kChunkSize - 1) / kChunkSize;
+        std::vector<Result> results(keys.size());
+        std::vector<std::string> arenas(chunks);
+        FirstError error;
+        ParallelFor(chunks, threads, [&](size_t chunk) {
+            auto& values = arenas[chunk];
+            std::string value;
+            const size_t end = std::min(keys.size(), (chunk + 1) * kChunkSize);
+            for (size_t n = chunk * kChunkSize; n < end && !error.failed(); n++) {
+                const auto i = order[n];
+                auto status = current->db->Get(opts, ViewToSlice(keys[i]), &value);
+                if (status.IsNotFound()) continue;
+                if (!status.ok()) {
+                    error.Set(std::move(status));
+                    return;
+                }
+                results[i] = {static_cast<uint32_t>(chunk), values.size(), value.size(), true};
+                values.append(value);
+            }
+        });
+        if (error.failed()) {
+            PrintError("mget status='{}'", error.status().ToString());
+            return;
+        }
+
+        OutputBuffer out(stdout);
+        size_t found = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (!results[i].found) {
+                AppendDisplayKey(out, keys[i]);
+                out.Append(" (not found)\n");
+                continue;
+            }
+            found++;
+            const auto& result = results[i];
+            AppendDisplayRecord(
+                out, keys[i], std::string_view(arenas[result.chunk]).substr(result.offset, result.length));
+        }
+        out.Flush();
+        println("found {} of {}", found, keys.size());
+    }
+};
+
+// Counts keys of a range on parallel workers without looking at any value
+struct CountFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {"--estimate"}, {"--threads"});
+        if (!cmd) return;
+        if (cmd->positional.size() > 2) {
+            PrintError("count expected [start] [end]");
+            return;
+        }
+        auto threads = cmd->GetNumber<size_t>("--threads", DefaultThreads());
+        if (!threads) return;
+
+        const auto range = EncodeRange(cmd->positional, "count");
+        if (!range) return;
+
+        if (cmd->Has("--estimate")) {
+            auto estimate = Estimate(*range, *threads);
+            if (!estimate) {
+                PrintError("count status='{}'", estimate.error().ToString());
+            } else if (estimate->exact) {
+                println("{}", estimate->keys);
+            } else {
+                println("~{} (sampled {} keys)", estimate->keys, estimate->sampled);
+            }
+            return;
+        }
+
+        auto count = Count(*range, *threads);
+        if (!count) {
+            PrintError("count status='{}'", count.error().ToString());
+            return;
+        }
+        println("{}", *count);
+    }
+
+    static auto Count(const KeyRange& range, size_t threads) -> std::expected<uint64_t, leveldb::Status> {
+        ScopedSnapshot snapshot(*current);
+        leveldb::ReadOptions opts{};
+        opts.fill_cache = false;
+        opts.snapshot = snapshot.get();
+
+        const auto parts = SplitRange(*current, range, threads > 1 ? threads * 4 : 1);
+        std::atomic<uint64_t> total = 0;
+        FirstError error;
+        ParallelFor(parts.size(), threads, [&](size_t i) {
+            auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(opts));
+            uint64_t count = 0;
+            auto status = ScanRange(*it, parts[i], false, [&](leveldb::Iterator&) {
+                count++;
+                return true;
+            });
+            total += count;
+            if (!status.ok()) error.Set(std::move(status));
+        });
+
+        if (error.failed()) return std::unexpected(error.status());
+        return total.load();
+    }
+
+    struct EstimateResult {
+        uint64_t keys = 0;
+        uint64_t sampled = 0;  // Keys actually visited
+        bool exact = false;
+    };
+
+    // Walks the first kSampleKeys keys of each of SplitRange's equal sized parts. Parts that end before that are
+    // counted exactly, the others are scaled by the keys per byte seen over the samples that hit the limit. Memtable
+    // contents have no size, if every sample lies there the exact count is cheap and used instead.
+    static auto Estimate(const KeyRange& range, size_t threads) -> std::expected<EstimateResult, leveldb::Status> {
+        static constexpr size_t kParts = 64;
+        static constexpr uint64_t kSampleKeys = 2048;
+
+        ScopedSnapshot snapshot(*current);
+        leveldb::ReadOptions opts{};
+        opts.fill_cache = false;
+        opts.snapshot = snapshot.get();
+
+        struct Sample {
+            uint64_t keys = 0;
+            std::optional<std::string> limit;  // First key not visited, set when the sample hit kSampleKeys
+        };
+        const auto parts = SplitRange(*current, range, kParts);
+        std::vector<Sample> samples(parts.size());
+        std::string last;
+        FirstError error;
+        ParallelFor(parts.size(), threads, [&](size_t i) {
+            auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(opts));
+            auto& sample = samples[i];
+            auto status = ScanRange(*it, parts[i], false, [&](leveldb::Iterator& row) {
+                if (sample.keys == kSampleKeys) {
+                    sample.limit = row.key().ToString();
+                    return false;
+                }
+                sample.keys++;
+                return true;
+            });
+            if (status.ok() && i + 1 == parts.size() && !parts[i].end) {
+                status = ScanRange(*it, parts[i], true, [&](leveldb::Iterator& row) {
+                    last = row.key().ToString();
+                    return false;
+                });
+            }
+            if (!status.ok()) error.Set(std::move(status));
+        });
+        if (error.failed()) return std::unexpected(error.status());
+
+        EstimateResult result;
+        const auto after_last = last + '\0';
+        std::vector<leveldb::Range> ranges;
+        for (size_t i = 0; i < parts.size(); i++) {
+            result.sampled += samples[i].keys;
+            if (!samples[i].limit) {
+                result.keys += samples[i].keys;
+                continue;
+            }
+            ranges.emplace_back(parts[i].start, *samples[i].limit);
+            ranges.emplace_back(parts[i].start, parts[i].end ? *parts[i].end : after_last);
+        }
+        if (ranges.empty()) {
+            result.exact = true;
+            return result;
+        }
+
+        std::vector<uint64_t> sizes(ranges.size());
+        current->db->GetApproximateSizes(ranges.data(), static_cast<int>(ranges.size()), sizes.data());
+        uint64_t sampled_keys = 0;
+        uint64_t sampled_bytes = 0;
+        uint64_t remaining_bytes = 0;
+        for (size_t i = 0, j = 0; i < parts.size(); i++) {
+            if (!samples[i].limit) continue;
+            sampled_keys += samples[i].keys;
+            sampled_bytes += sizes[j++];
+            remaining_bytes += sizes[j++];
+        }
+        if (sampled_bytes == 0) {
+            auto count = Count(range, threads);
+            if (!count) return std::unexpected(count.error());
+            return EstimateResult{.keys = *count, .sampled = *count, .exact = true};
+        }
+        result.keys += static_cast<uint64_t>(static_cast<double>(remaining_bytes) * static_cast<double>(sampled_keys) /
+                                             static_cast<double>(sampled_bytes));
+        return result;
+    }
+};
+
+// On-disk bytes of [start, end) from the table index blocks, without reading any record
+struct SizeFunctor {
+    void operator()(const ArgsVector& args) const {
+        const auto bounds = EncodeRange(args, "size");
+        if (!bounds) return;
+        const leveldb::Range range(bounds->start, *bounds->end);
+        uint64_t bytes = 0;
+        current->db->GetApproximateSizes(&range, 1, &bytes);
+        println("{} bytes ({:.1f} MiB)", bytes, static_cast<double>(bytes) / (1 << 20));
+    }
+};
+
+// Files and bytes per level, parsed from leveldb.sstables
+struct LiveTable {
+    size_t level = 0;
+    uint64_t number = 0;
+    uint64_t size = 0;
+
+    auto operator==(const LiveTable&) const -> bool = default;
+};
+
+// The tables of the db's current version, parsed from leveldb.sstables
+auto LiveTables(leveldb::DB& db) -> std::vector<LiveTable> {
+    static constexpr size_t kMaxLevel = 6;  // leveldb::config::kNumLevels - 1
+    std::vector<LiveTable> tables;
+    std::string sstables;
+    if (!db.GetProperty("leveldb.sstables", &sstables)) return tables;
+
+    size_t level = 0;
+    for (std::string_view rest = sstables; !rest.empty();) {
+        const auto eol = std::min(rest.find('\n'), rest.size());
+        auto line = rest.substr(0, eol);
+        rest.remove_prefix(std::min(eol + 1, rest.size()));
+
+        static constexpr std::string_view kLevelHeader = "--- level ";
+        if (line.starts_with(kLevelHeader)) {
+            line.remove_prefix(kLevelHeader.size());
+            std::from_chars(line.data(), line.data() + line.size(), level);
+            level = std::min(level, kMaxLevel);
+            continue;
+        }
+
+        // " <file number>:<file size>[<smallest> .. <largest>]"
+        const auto colon = line.find(':');
+        const auto bracket = line.find('[', colon);
+        if (bracket == std::string_view::npos) continue;
+        LiveTable table{.level = level};
+        const char* number = line.data() + line.find_first_not_of(' ');
+        const auto [number_end, number_ec] = std::from_chars(number, line.data() + colon, table.number);
+        const auto [size_end, size_ec] = std::from_chars(line.data() + colon + 1, line.data() + bracket, table.size);
+        if (number_ec != std::errc() || number_end != line.data() + colon) continue;
+        if (size_ec != std::errc() || size_end != line.data() + bracket) continue;
+        tables.push_back(table);
+    }
+    return tables;
+}
+
+struct LevelSummary {
+    static constexpr size_t kLevels = 7;  // leveldb::config::kNumLevels
+
+    std::array<uint64_t, kLevels> files{};
+    std::array<uint64_t, kLevels> bytes{};
+
+    static auto Read(leveldb::DB& db) -> LevelSummary {
+        LevelSummary summary;
+        for (const auto& table : LiveTables(db)) {
+            summary.files[table.level]++;
+            summary.bytes[table.level] += table.size;
+        }
+        return summary;
+    }
+};
+
+// Pushes a key range down the levels to drop tombstones and overwritten values
+struct CompactFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {}, {});
+        if (!cmd) return;
+        if (cmd->positional.size() > 2) {
+            PrintError("compact expected [start] [end]");
+            return;
+        }
+
+        auto range = EncodeRange(cmd->positional, "compact");
+        if (!range) return;
+        std::optional<std::string> start;
+        std::optional<std::string> end = std::move(range->end);
+        if (!cmd->positional.empty()) start = std::move(range->start);
+        Compact(*current->db, start, end);
+    }
+
+    // Missing bounds extend the range to the first or last key of the db
+    static void Compact(leveldb::DB& db,
+                        const std::optional<std::string>& start,
+                        const std::optional<std::string>& end) {
+        const auto before = LevelSummary::Read(db);
+        const auto begin_slice = start ? ViewToSlice(*start) : leveldb::Slice();
+        const auto end_slice = end ? ViewToSlice(*end) : leveldb::Slice();
+
+        const auto started = std::chrono::steady_clock::now();
+        db.CompactRange(start ? &begin_slice : nullptr, end ? &end_slice : nullptr);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+
+        PrintSummary(before, LevelSummary::Read(db));
+        println("compacted in {:.3f} s", elapsed.count());
+    }
+
+    static void PrintSummary(const LevelSummary& before, const LevelSummary& after) {
+        static constexpr auto kRowFmt = "{:<8}{:>10}{:>14}{:>14}{:>14}";
+        println(kRowFmt, "Level", "Files", "Bytes", "Files after", "Bytes after");
+        for (size_t level = 0; level < LevelSummary::kLevels; level++) {
+            if (before.files[level] == 0 && after.files[level] == 0) continue;
+            println(kRowFmt, level, before.files[level], before.bytes[level], after.files[level], after.bytes[level]);
+        }
+        const auto total = [](const auto& values) { return std::accumulate(values.begin(), values.end(), 0ULL); };
+        println(kRowFmt, "total", total(before.files), total(before.bytes), total(after.files), total(after.bytes));
+    }
+};
+
+// Consistent copy of the open db while it stays in use. The memtable is flushed first so every key lives in a
+// table, then the live tables are hard linked (copied across file systems) and CURRENT, the MANIFEST and the logs
+// copied. If a compaction changed the set of tables meanwhile the copy is redone, reusing what is already there.
+// --incremental updates an earlier backup: tables already present with the same size are kept, since table files
+// are never rewritten, and those no longer live are removed.
+struct BackupFunctor {
+    static constexpr int kAttempts = 3;
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {"--incremental"}, {});
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("backup expected <dir>");
+            return;
+        }
+
+        const fs::path dst = fs::absolute(cmd->positional[0]).lexically_normal();
+        auto src = fs::absolute(current->read_only ? current->copy_dir : fs::path(current->path)).lexically_normal();
+        std::error_code ec;
+        if (fs::equivalent(src, dst, ec)) {
+            PrintError("backup {} is the database itself", dst.string());
+            return;
+        }
+        // A full backup never overwrites, an incremental one only a directory that holds a backup
+        const bool exists = fs::exists(dst, ec) && !fs::is_empty(dst, ec);
+        if (exists && !cmd->Has("--incremental")) {
+            PrintError("backup {} is not empty, --incremental updates an earlier backup", dst.string());
+            return;
+        }
+        if (exists && !fs::exists(dst / "CURRENT", ec)) {
+            PrintError("backup {} has no CURRENT file, it does not hold a backup", dst.string());
+            return;
+        }
+        if (current->pending_batch && current->pending_batch->ops != 0) {
+            println("warning: the {} uncommitted ops of the batch are not part of the backup",
+                    current->pending_batch->ops);
+        }
+
+        fs::create_directories(dst, ec);
+        if (ec) {
+            PrintError("backup create {} '{}'", dst.string(), ec.message());
+            return;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        FlushMemTable(*current->db);
+        CheckpointStats stats;
+        for (int attempt = 1;; attempt++) {
+            const auto tables = LiveTables(*current->db);
+            auto copied = CopyBackup(src, dst, tables, stats);
+            if (!copied) {
+                PrintError("backup {}", copied.error());
+                return;
+            }
+            if (*copied && LiveTables(*current->db) == tables) {
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                println("OK backup of {} tables in {:.2f}s: {} files linked, {} copied ({:.1f} MB), {} unchanged",
+                        tables.size(),
+                        elapsed.count(),
+                        stats.linked,
+                        stats.copied,
+                        static_cast<double>(stats.copied_bytes) / (1 << 20),
+                        stats.skipped);
+                return;
+            }
+            if (attempt == kAttempts) {
+                PrintError("backup compactions kept changing the tables, {} attempts failed", kAttempts);
+                return;
+            }
+        }
+    }
+
+    // CompactRange writes the memtable to a table before it looks at the range, an empty range leaves the rest alone
+    static void FlushMemTable(leveldb::DB& db) {
+        const leveldb::Slice empty;
+        db.CompactRange(&empty, &empty);
+    }
+
+    // false when a table was compacted away before it could be linked, the caller then starts over
+    static auto CopyBackup(const fs::path& src, const fs::path& dst, const std::vector<LiveTable>& tables,
+                           CheckpointStats& stats) -> std::expected<bool, std::string> {
+        const auto fail = [](std::string_view what, const fs::path& file, const std::error_code& ec) {
+            return std::unexpected(std::format("{} {} '{}'", what, file.string(), ec.message()));
+        };
+
+        // Older dbs name their tables .sst, leveldb reads both
+        std::error_code ec;
+        std::vector<fs::path> keep;
+        JobTicker ticker;
+        for (const auto& table : tables) {
+            auto from = src / std::format("{:06}.ldb", table.number);
+            if (!fs::exists(from, ec)) from.replace_extension(".sst");
+            const auto to = dst / from.filename();
+            keep.push_back(to.filename());
+            if (!ticker.Tick(table.size)) return std::unexpected(Cancelled().ToString());
+
+            if (fs::exists(to, ec) && fs::file_size(to, ec) == table.size) {
+                stats.skipped++;
+                continue;
+            }
+            fs::remove(to, ec);
+            ec = LinkOrCopy(from, to, stats);
+            if (ec == std::errc::no_such_file_or_directory) return false;
+            if (ec) return fail("link", from, ec);
+        }
+
+        // Replaced through a rename, so an earlier backup being updated stays readable up to the switch of CURRENT
+        const auto replace = [&](const fs::path& file) -> std::error_code {
+            auto temp = dst / file.filename();
+            temp += ".tmp";
+            auto error = CopyFile(file, temp, stats);
+            if (!error) fs::rename(temp, dst / file.filename(), error);
+            keep.push_back(file.filename());
+            return error;
+        };
+
+        std::string current_file;
+        if (!ReadSmallFile(src / "CURRENT", current_file)) {
+            return std::unexpected(std::format("read {} '{}'", (src / "CURRENT").string(), std::strerror(errno)));
+        }
+        const auto manifest = src / std::string_view(current_file).substr(0, current_file.find('\n'));
+        if (ec = replace(manifest); ec) return fail("copy", manifest, ec);
+        for (const auto& entry : fs::directory_iterator(src, ec)) {
+            if (entry.path().extension() != ".log") continue;
+            ec = replace(entry.path());
+            if (ec && ec != std::errc::no_such_file_or_directory) return fail("copy", entry.path(), ec);
+        }
+        if (ec) return fail("list", src, ec);
+        if (ec = replace(src / "CURRENT"); ec) return fail("copy", src / "CURRENT", ec);
+
+        // Only files leveldb would have created are removed, anything else in the directory is left alone
+        std::vector<fs::path> obsolete;
+        for (const auto& entry : fs::directory_iterator(dst, ec)) {
+            const auto name = entry.path().filename();
+            const auto extension = name.extension();
+            const bool db_file = extension == ".ldb" || extension == ".sst" || extension == ".log" ||
+                                 name.string().starts_with("MANIFEST-");
+            if (db_file && std::ranges::find(keep, name) == keep.end()) obsolete.push_back(entry.path());
+        }
+        for (const auto& file : obsolete) fs::remove(file, ec);
+        return true;
+    }
+
+    static auto ReadSmallFile(const fs::path& path, std::string& contents) -> bool {
+        FilePtr file(std::fopen(path.c_str(), "rb"), &std::fclose);
+        if (file == nullptr) return false;
+        char buffer[4096];
+        while (const size_t n = std::fread(buffer, 1, sizeof(buffer), file.get())) contents.append(buffer, n);
+        return !std::ferror(file.get());
+    }
+};
+
+// Rebuilds the MANIFEST of a db that no longer opens from the tables and logs found in its directory. Entries in
+// corrupted blocks are dropped, RepairDB logs what it kept to <path>/LOG. leveldb takes no lock for a repair, so the
+// LOCK file is held here for its duration and a db open in this or any other process is refused.
+struct RepairFunctor {
+    void operator()(const ArgsVector& args) const {
+        const std::string path(args[0]);
+        std::error_code ec;
+        for (const auto& handle : handles) {
+            if (fs::equivalent(handle->path, path, ec)) {
+                PrintError("repair {} is open as {}, close it first", path, handle->name);
+                return;
+            }
+        }
+
+        auto* env = leveldb::Env::Default();
+        leveldb::FileLock* lock = nullptr;
+        if (const auto status = env->LockFile(path + "/LOCK", &lock); !status.ok()) {
+            PrintError("repair {} is in use or unreadable, status='{}'", path, status.ToString());
+            return;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto status = leveldb::RepairDB(path, leveldb::Options{});
+        env->UnlockFile(lock);
+        if (!status.ok()) {
+            PrintError("repair {} status='{}'", path, status.ToString());
+            return;
+        }
+        println("OK repaired {} in {:.2f}s, {}/LOG lists what was recovered",
+                path,
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                path);
+    }
+};
+
+// Reads every live table of the current db in full with checksums verified, one table per worker, straight from
+// the files and past the block cache. A corrupted block does not end the read of its table, the first one is
+// reported with the keys around it. --paranoid also verifies the index and meta blocks on open and checks that
+// every entry is a well formed internal key in order. Logs and the memtable are checked by leveldb on open.
+struct VerifyFunctor {
+    struct Result {
+        LiveTable table;
+        uint64_t entries = 0;
+        bool missing = false;               // Compacted away before it was opened
+        leveldb::Status status;             // First corruption
+        std::optional<std::string> after;   // Last good key before it, none at the start of the table
+        std::optional<std::string> before;  // First good key after it, none when it reaches the end
+    };
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {"--paranoid"}, {"--threads"});
+        if (!cmd) return;
+        if (!cmd->positional.empty()) {
+            PrintError("verify takes no positional arguments");
+            return;
+        }
+        auto threads = cmd->GetNumber<size_t>("--threads", DefaultThreads());
+        if (!threads) return;
+
+        const auto dir = current->read_only ? current->copy_dir : fs::path(current->path);
+        auto tables = LiveTables(*current->db);
+        // Largest first, so the last tables to finish are small ones
+        std::ranges::sort(tables, [](const LiveTable& a, const LiveTable& b) { return a.size > b.size; });
+        const bool paranoid = cmd->Has("--paranoid");
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<Result> results(tables.size());
+        FirstError error;
+        ParallelFor(tables.size(), *threads, [&](size_t i) {
+            results[i].table = tables[i];
+            if (!error.failed()) Verify(dir, paranoid, results[i], error);
+        });
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (error.failed()) {
+            PrintError("verify status='{}'", error.status().ToString());
+            return;
+        }
+        Print(results, seconds);
+    }
+
+private:
+    static void Verify(const fs::path& dir, bool paranoid, Result& result, FirstError& error) {
+        // Older dbs name their tables .sst, leveldb reads both
+        std::error_code ec;
+        auto path = dir / std::format("{:06}.ldb", result.table.number);
+        if (!fs::exists(path, ec)) path.replace_extension(".sst");
+
+        leveldb::RandomAccessFile* raw_file = nullptr;
+        result.status = leveldb::Env::Default()->NewRandomAccessFile(path.string(), &raw_file);
+        std::unique_ptr<leveldb::RandomAccessFile> file(raw_file);
+        if (result.status.IsNotFound()) {
+            result.missing = true;
+            result.status = leveldb::Status::OK();
+            return;
+        }
+        if (!result.status.ok()) return;
+
+        // The index is searched by internal key, no filter or block cache is loaded
+        const InternalKeyOrder order;
+        leveldb::Options options{};
+        options.comparator = &order;
+        options.paranoid_checks = paranoid;
+        leveldb::Table* raw_table = nullptr;
+        result.status = leveldb::Table::Open(options, file.get(), result.table.size, &raw_table);
+        std::unique_ptr<leveldb::Table> table(raw_table);
+        if (!result.status.ok()) return;
+
+        leveldb::ReadOptions opts{};
+        opts.verify_checksums = true;
+        opts.fill_cache = false;
+        auto it = std::unique_ptr<leveldb::Iterator>(table->NewIterator(opts));
+        std::optional<std::string> last;      // Key read before the current one
+        std::optional<std::string> previous;  // The same if well formed, only such keys are compared
+        JobTicker ticker;
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            const auto key = it->key();
+            if (!ticker.Tick(key.size() + it->value().size())) return error.Set(Cancelled());
+            result.entries++;
+
+            // A corrupted block is skipped, the iterator keeps its status and goes on with the next block
+            auto status = it->status();
+            bool valid = true;
+            if (paranoid) {
+                valid = InternalKey::Valid(key);
+                if (status.ok() && !valid) {
+                    status = leveldb::Status::Corruption("malformed internal key");
+                } else if (status.ok() && previous && order.Compare(*previous, key) >= 0) {
+                    status = leveldb::Status::Corruption("keys out of order");
+                }
+            }
+            if (!status.ok() && result.status.ok()) {
+                result.status = std::move(status);
+                result.after = last;
+                result.before = key.ToString();
+            }
+            last = key.ToString();
+            if (valid) {
+                previous = last;
+            } else {
+                previous.reset();
+            }
+        }
+        if (!it->status().ok() && result.status.ok()) {
+            result.status = it->status();
+            result.after = last;
+        }
+    }
+
+    static void Print(const std::vector<Result>& results, double seconds) {
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+        uint64_t missing = 0;
+        std::vector<const Result*> corrupted;
+        for (const auto& result : results) {
+            entries += result.entries;
+            bytes += result.table.size;
+            missing += result.missing ? 1 : 0;
+            if (!result.status.ok()) corrupted.push_back(&result);
+        }
+        std::ranges::sort(corrupted, {}, [](const Result* result) { return result->table.number; });
+
+        const auto show = [](const std::optional<std::string>& key, std::string_view none) {
+            if (!key) return std::string(none);
+            std::string text = "'";
+            StringOutput out{text};
+            AppendDisplayKey(out, InternalKey::Valid(*key) ? SliceToView(InternalKey::UserKey(*key)) : *key);
+            text += '\'';
+            return text;
+        };
+        for (const auto* result : corrupted) {
+            println("{:06} level {}: {} between {} and {}",
+                    result->table.number,
+                    result->table.level,
+                    result->status.ToString(),
+                    show(result->after, "the start of the table"),
+                    show(result->before, "the end of the table"));
+        }
+
+        println("verified {} tables, {} entries, {:.1f} MB in {:.2f}s ({:.1f} MB/s)",
+                results.size() - missing,
+                entries,
+                static_cast<double>(bytes) / (1 << 20),
+                seconds,
+                seconds > 0 ? static_cast<double>(bytes) / (1 << 20) / seconds : 0.0);
+        if (missing != 0) println("{} tables were compacted away before they were read", missing);
+        if (!corrupted.empty()) PrintError("verify found corruption in {} tables", corrupted.size());
+    }
+};
+
+// Deletes every key of a range through chunked batches, one write and so at most one sync per chunk. Keys come
+// from a snapshot so the walk never sees its own tombstones.
+struct DeleteRange {
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t kDefaultChunk = 10000;
+
+    static auto Parse(const ArgsVector& args, std::string_view name) -> std::optional<CommandArgs> {
+        if (current->pending_batch) {
+            PrintError("{} not allowed while a batch is in progress", name);
+            return std::nullopt;
+        }
+        return ParseCommandArgs(args, {"--dry-run", "--compact"}, {"--chunk"});
+    }
+
+    static void Run(std::string_view name, const CommandArgs& cmd, const KeyRange& range) {
+        auto chunk = cmd.GetNumber<size_t>("--chunk", kDefaultChunk);
+        if (!chunk) return;
+        if (*chunk == 0) {
+            PrintError("{} --chunk must be at least 1", name);
+            return;
+        }
+        const bool dry_run = cmd.Has("--dry-run");
+
+        ScopedSnapshot snapshot(*current, false);
+        leveldb::ReadOptions opts{};
+        opts.fill_cache = false;
+        opts.snapshot = snapshot.get();
+        auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(opts));
+
+        leveldb::WriteBatch batch;
+        size_t pending = 0;
+        uint64_t rows = 0;
+        leveldb::Status write_status;
+        const auto flush = [&] {
+            write_status = current->db->Write(durability.NextWrite(pending), &batch);
+            batch.Clear();
+            if (write_status.ok()) rows += pending;
+            pending = 0;
+            return write_status.ok();
+        };
+
+        const auto start = Clock::now();
+        auto status = ScanRange(*it, range, false, [&](leveldb::Iterator& row) {
+            if (dry_run) {
+                rows++;
+                return true;
+            }
+            batch.Delete(row.key());
+            return ++pending < *chunk || flush();
+        });
+        if (status.ok() && pending != 0) flush();
+        if (status.ok()) status = write_status;
+        const auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        if (!status.ok()) {
+            PrintError("{} status='{}'", name, status.ToString());
+            println("deleted {} rows before the error", rows);
+            return;
+        }
+        println("{} {} rows in {:.2f}s ({:.0f} rows/s)",
+                dry_run ? "would delete" : "OK deleted",
+                rows,
+                seconds,
+                seconds > 0 ? static_cast<double>(rows) / seconds : 0.0);
+
+        if (cmd.Has("--compact") && !dry_run && rows != 0) {
+            CompactFunctor::Compact(*current->db, range.start, range.end);
+        }
+    }
+};
+
+struct DeleteRangeFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = DeleteRange::Parse(args, "delrange");
+        if (!cmd) return;
+        if (cmd->positional.size() != 2) {
+            PrintError("delrange expected <start> <end>");
+            return;
+        }
+        const auto range = EncodeRange(cmd->positional, "delrange");
+        if (!range) return;
+        DeleteRange::Run("delrange", *cmd, *range);
+    }
+};
+
+struct DeletePrefixFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto cmd = DeleteRange::Parse(args, "delprefix");
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("delprefix expected <prefix>");
+            return;
+        }
+        std::string scratch;
+        const auto prefix = EncodeArgument(key_codec, cmd->positional[0], scratch, "delprefix prefix");
+        if (!prefix) return;
+        DeleteRange::Run("delprefix", *cmd, KeyRange::Prefix(*prefix));
+    }
+};
+
+// Merge-joins two iterators over range and calls report(kind, key) for every key of either side, stopping early when
+// it returns false. Values of keys in both are compared by length first and then memcmp, which stops at the first
+// differing byte.
+template <typename F>
+auto MergeDiff(leveldb::Iterator& a, leveldb::Iterator& b, const KeyRange& range, F report) -> leveldb::Status {
+    const auto valid = [&](leveldb::Iterator& it) { return it.Valid() && range.BeforeEnd(it.key()); };
+    a.Seek(range.start);
+    b.Seek(range.start);
+    JobTicker ticker;
+    while (true) {
+        const bool has_a = valid(a);
+        const bool has_b = valid(b);
+        if (!has_a && !has_b) break;
+        if (!ticker.Tick((has_a ? a.key().size() : 0) + (has_b ? b.key().size() : 0))) return Cancelled();
+
+        const int order = !has_a ? 1 : !has_b ? -1 : a.key().compare(b.key());
+        if (order < 0) {
+            if (!report(DiffKind::only_a, a.key())) break;
+            a.Next();
+        } else if (order > 0) {
+            if (!report(DiffKind::only_b, b.key())) break;
+            b.Next();
+        } else {
+            if (!report(a.value() == b.value() ? DiffKind::same : DiffKind::changed, a.key())) break;
+            a.Next();
+            b.Next();
+        }
+    }
+    if (!a.status().ok()) return a.status();
+    return b.status();
+}
+
+// Compares the current db with another open one, both read under a snapshot. Parts from SplitRange are diffed on
+// parallel workers and their output printed in key order.
+struct DiffFunctor {
+    static constexpr uint64_t kDefaultLimit = 1000;
+    static constexpr std::array<char, enchantum::count<DiffKind>> kSymbols = {' ', '-', '+', '~'};
+
+    struct Part {
+        std::string lines;
+        uint64_t line_count = 0;
+        std::array<uint64_t, enchantum::count<DiffKind>> counts{};
+    };
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {"--count"}, {"--threads", "--limit"});
+        if (!cmd) return;
+        auto* other = !cmd->positional.empty() && cmd->positional[0].starts_with('@')
+                          ? FindHandle(cmd->positional[0].substr(1))
+                          : nullptr;
+        if (other == nullptr || cmd->positional.size() > 3) {
+            PrintError("diff expected @name of another open database and [start] [end]");
+            return;
+        }
+        if (other == current) {
+            PrintError("diff both sides are {}", other->name);
+            return;
+        }
+        auto threads = cmd->GetNumber<size_t>("--threads", DefaultThreads());
+        auto limit = cmd->GetNumber<uint64_t>("--limit", kDefaultLimit);
+        if (!threads || !limit) return;
+
+        const auto range = EncodeRange(ArgsVector(cmd->positional).subspan(1), "diff");
+        if (!range) return;
+
+        // Lines to print, --limit 0 means all of them
+        const uint64_t lines = cmd->Has("--count") ? 0 : *limit == 0 ? std::numeric_limits<uint64_t>::max() : *limit;
+        auto parts = Diff(*current, *other, *range, *threads, lines);
+        if (!parts) {
+            PrintError("diff status='{}'", parts.error().ToString());
+            return;
+        }
+        Print(*parts, lines, current->name, other->name);
+    }
+
+    // At most limit lines are kept per part, that is all the first limit lines of the diff can come from
+    static auto Diff(const Handle& a, const Handle& b, const KeyRange& range, size_t threads, uint64_t limit)
+        -> std::expected<std::vector<Part>, leveldb::Status> {
+        ScopedSnapshot snapshot_a(a);
+        ScopedSnapshot snapshot_b(b);
+        leveldb::ReadOptions opts_a{};
+        opts_a.fill_cache = false;
+        opts_a.snapshot = snapshot_a.get();
+        leveldb::ReadOptions opts_b = opts_a;
+        opts_b.snapshot = snapshot_b.get();
+
+        const auto ranges = SplitRange(a, range, threads > 1 ? threads * 4 : 1);
+        std::vector<Part> parts(ranges.size());
+        FirstError error;
+        ParallelFor(ranges.size(), threads, [&](size_t i) {
+            auto it_a = std::unique_ptr<leveldb::Iterator>(a.db->NewIterator(opts_a));
+            auto it_b = std::unique_ptr<leveldb::Iterator>(b.db->NewIterator(opts_b));
+            auto& part = parts[i];
+            auto status = MergeDiff(*it_a, *it_b, ranges[i], [&](DiffKind kind, const leveldb::Slice& key) {
+                part.counts[static_cast<size_t>(kind)]++;
+                if (kind == DiffKind::same || part.line_count == limit) return true;
+                part.lines.push_back(kSymbols[static_cast<size_t>(kind)]);
+                part.lines.push_back(' ');
+                StringOutput lines{part.lines};
+                AppendDisplayKey(lines, SliceToView(key));
+                part.lines.push_back('\n');
+                part.line_count++;
+                return true;
+            });
+            if (!status.ok()) error.Set(std::move(status));
+        });
+
+        if (error.failed()) return std::unexpected(error.status());
+        return parts;
+    }
+
+    static void Print(const std::vector<Part>& parts,
+                      uint64_t limit,
+                      std::string_view name_a,
+                      std::string_view name_b) {
+        std::array<uint64_t, enchantum::count<DiffKind>> counts{};
+        uint64_t printed = 0;
+        OutputBuffer out(stdout);
+        for (const auto& part : parts) {
+            for (size_t kind = 0; kind < counts.size(); kind++) counts[kind] += part.counts[kind];
+
+            std::string_view lines = part.lines;
+            for (; !lines.empty() && printed != limit; printed++) {
+                const auto eol = lines.find('\n') + 1;
+                out.Append(lines.substr(0, eol));
+                lines.remove_prefix(eol);
+            }
+        }
+        out.Flush();
+
+        const auto same = counts[static_cast<size_t>(DiffKind::same)];
+        const auto differences = std::accumulate(counts.begin(), counts.end(), uint64_t{0}) - same;
+        println("{} only in {}, {} only in {}, {} changed, {} equal",
+                counts[static_cast<size_t>(DiffKind::only_a)], name_a,
+                counts[static_cast<size_t>(DiffKind::only_b)], name_b,
+                counts[static_cast<size_t>(DiffKind::changed)], same);
+        if (limit != 0 && printed < differences) {
+            println("showed the first {} differences, --limit 0 shows all", printed);
+        }
+    }
+};
+
+// Tails writes to the keys with a prefix. After every --interval ms the range is read again under a new snapshot in
+// the sub-ranges SplitRange cut it into on start, and only a sub-range whose fingerprint, a hash over its keys and
+// values, differs from the previous pass is diffed against the previous snapshot. Reads skip the block cache, and the
+// next pass waits for the interval after this one finished, so a slow pass never piles up on a busy db.
+struct WatchFunctor {
+    static constexpr uint64_t kDefaultInterval = 1000;
+    static constexpr size_t kBlocks = 64;
+    static constexpr auto kPollSlice = std::chrono::milliseconds(50);
+
+    struct Fingerprint {
+        uint64_t hash = 0;
+        uint64_t keys = 0;
+
+        auto operator==(const Fingerprint&) const -> bool = default;
+    };
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {}, {"--interval", "--count"});
+        if (!cmd) return;
+        if (cmd->positional.size() != 1) {
+            PrintError("watch expected <prefix>");
+            return;
+        }
+        auto interval = cmd->GetNumber<uint64_t>("--interval", kDefaultInterval);
+        auto passes = cmd->GetNumber<uint64_t>("--count", 0);
+        if (!interval || !passes) return;
+        std::string scratch;
+        const auto prefix = EncodeArgument(key_codec, cmd->positional[0], scratch, "watch prefix");
+        if (!prefix) return;
+
+        Watch(*current, KeyRange::Prefix(*prefix), std::chrono::milliseconds(*interval), *passes);
+    }
+
+    // Runs passes times, 0 until cancelled
+    static void Watch(const Handle& handle,
+                      const KeyRange& range,
+                      std::chrono::milliseconds interval,
+                      uint64_t passes) {
+        leveldb::ReadOptions opts{};
+        opts.fill_cache = false;
+        const auto blocks = SplitRange(handle, range, kBlocks);
+        std::vector<Fingerprint> fingerprints(blocks.size());
+
+        auto previous = std::make_unique<ScopedSnapshot>(handle, false);
+        opts.snapshot = previous->get();
+        for (size_t i = 0; i < blocks.size(); i++) {
+            auto fingerprint = Take(handle, opts, blocks[i]);
+            if (!fingerprint) return Stop(fingerprint.error());
+            fingerprints[i] = *fingerprint;
+        }
+        println("watching {} keys in {} blocks every {} ms, cancel or Ctrl-C stops",
+                std::accumulate(fingerprints.begin(), fingerprints.end(), uint64_t{0},
+                                [](uint64_t sum, const Fingerprint& f) { return sum + f.keys; }),
+                blocks.size(),
+                interval.count());
+
+        std::array<uint64_t, enchantum::count<DiffKind>> counts{};
+        uint64_t pass = 0;
+        while ((passes == 0 || pass < passes) && Sleep(interval)) {
+            pass++;
+            auto next = std::make_unique<ScopedSnapshot>(handle, false);
+            leveldb::ReadOptions opts_next = opts;
+            opts_next.snapshot = next->get();
+            OutputBuffer out(stdout);
+            for (size_t i = 0; i < blocks.size(); i++) {
+                auto fingerprint = Take(handle, opts_next, blocks[i]);
+                if (!fingerprint) return Stop(fingerprint.error());
+                if (*fingerprint == fingerprints[i]) continue;
+                fingerprints[i] = *fingerprint;
+
+                auto it_a = std::unique_ptr<leveldb::Iterator>(handle.db->NewIterator(opts));
+                auto it_b = std::unique_ptr<leveldb::Iterator>(handle.db->NewIterator(opts_next));
+                auto status = MergeDiff(*it_a, *it_b, blocks[i], [&](DiffKind kind, const leveldb::Slice& key) {
+                    if (kind == DiffKind::same) return true;
+                    counts[static_cast<size_t>(kind)]++;
+                    out.Append(DiffFunctor::kSymbols[static_cast<size_t>(kind)]);
+                    out.Append(' ');
+                    if (kind == DiffKind::only_a) {
+                        AppendDisplayKey(out, SliceToView(key));
+                        out.Append('\n');
+                    } else {
+                        AppendDisplayRecord(out, SliceToView(key), SliceToView(it_b->value()));
+                    }
+                    return true;
+                });
+                if (!status.ok()) return Stop(status);
+            }
+            out.Flush();
+            previous = std::move(next);
+            opts.snapshot = previous->get();
+        }
+        println("watched {} passes, {} added, {} changed, {} removed",
+                pass,
+                counts[static_cast<size_t>(DiffKind::only_b)],
+                counts[static_cast<size_t>(DiffKind::changed)],
+                counts[static_cast<size_t>(DiffKind::only_a)]);
+    }
+
+private:
+    static auto Take(const Handle& handle, const leveldb::ReadOptions& opts, const KeyRange& block)
+        -> std::expected<Fingerprint, leveldb::Status> {
+        Fingerprint fingerprint;
+        auto it = std::unique_ptr<leveldb::Iterator>(handle.db->NewIterator(opts));
+        auto status = ScanRange(*it, block, false, [&](leveldb::Iterator& row) {
+            const auto key = std::hash<std::string_view>{}(SliceToView(row.key()));
+            const auto value = std::hash<std::string_view>{}(SliceToView(row.value()));
+            fingerprint.hash = (fingerprint.hash ^ key) * 0x9e3779b97f4a7c15ULL + value;
+            fingerprint.keys++;
+            return true;
+        });
+        if (!status.ok()) return std::unexpected(std::move(status));
+        return fingerprint;
+    }
+
+    // False once the job is cancelled, checked every kPollSlice
+    static auto Sleep(std::chrono::milliseconds interval) -> bool {
+        const auto until = std::chrono::steady_clock::now() + interval;
+        for (;;) {
+            if (current_job != nullptr && current_job->cancel) return false;
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= until) return true;
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(until - now, kPollSlice));
+        }
+    }
+
+    // Cancelling is the usual way out of a watch and not an error
+    static void Stop(const leveldb::Status& status) {
+        if (current_job != nullptr && current_job->cancel) return;
+        PrintError("watch status='{}'", status.ToString());
+    }
+};
+
+// Key prefix and value size profile of a range from one pass over keys and value sizes. Keys sharing a prefix are
+// adjacent, so every part adds each prefix it sees once, with the totals of its run, to bounded space-saving
+// summaries that are merged at the end.
+struct AnalyzeFunctor {
+    static constexpr size_t kDefaultTop = 10;
+    static constexpr size_t kSketchFactor = 16;  // Summary capacity per reported prefix
+    static constexpr size_t kMinSketch = 1024;
+
+    struct Profile {
+        explicit Profile(size_t capacity)
+            : by_keys(capacity),
+              by_bytes(capacity) {}
+
+        void Merge(const Profile& other) {
+            by_keys.Merge(other.by_keys);
+            by_bytes.Merge(other.by_bytes);
+            value_sizes.Merge(other.value_sizes);
+            keys += other.keys;
+            key_bytes += other.key_bytes;
+            value_bytes += other.value_bytes;
+        }
+
+        SpaceSaving by_keys;
+        SpaceSaving by_bytes;  // Key plus value bytes
+        Histogram value_sizes;
+        uint64_t keys = 0;
+        uint64_t key_bytes = 0;
+        uint64_t value_bytes = 0;
+    };
+
+    // Prefixes are the first depth bytes, or with a delimiter everything up to and including its first occurrence
+    struct Prefixer {
+        size_t depth = 0;
+        std::optional<char> delimiter;
+
+        auto operator()(std::string_view key) const -> std::string_view {
+            if (!delimiter) return key.substr(0, depth);
+            const auto at = key.find(*delimiter);
+            return at == std::string_view::npos ? key : key.substr(0, at + 1);
+        }
+    };
+
+    void operator()(const ArgsVector& args) const {
+        auto cmd = ParseCommandArgs(args, {}, {"--prefix-depth", "--delimiter", "--top", "--threads"});
+        if (!cmd) return;
+        if (cmd->positional.size() > 2) {
+            PrintError("analyze expected [start] [end]");
+            return;
+        }
+        if (cmd->Has("--prefix-depth") && cmd->Has("--delimiter")) {
+            PrintError("analyze takes either --prefix-depth or --delimiter");
+            return;
+        }
+        auto threads = cmd->GetNumber<size_t>("--threads", DefaultThreads());
+        auto top = cmd->GetNumber<size_t>("--top", kDefaultTop);
+        auto depth = cmd->GetNumber<size_t>("--prefix-depth", 0);
+        if (!threads || !top || !depth) return;
+
+        // Without either option keys are grouped by their first ':' separated segment
+        Prefixer prefixer{*depth, std::nullopt};
+        if (auto delimiter = cmd->Get("--delimiter"); delimiter || !cmd->Has("--prefix-depth")) {
+            if (delimiter && delimiter->size() != 1) {
+                PrintError("analyze --delimiter expected one character got '{}'", *delimiter);
+                return;
+            }
+            prefixer.delimiter = delimiter ? delimiter->front() : ':';
+        }
+
+        const auto range = EncodeRange(cmd->positional, "analyze");
+        if (!range) return;
+
+        auto profile = Analyze(*range, prefixer, std::max(*top * kSketchFactor, kMinSketch), *threads);
+        if (!profile) {
+            PrintError("analyze status='{}'", profile.error().ToString());
+            return;
+        }
+        Print(*profile, *top);
+    }
+
+    static auto Analyze(const KeyRange& range, const Prefixer& prefixer, size_t capacity, size_t threads)
+        -> std::expected<Profile, leveldb::Status> {
+        ScopedSnapshot snapshot(*current);
+        leveldb::ReadOptions opts{};
+        opts.fill_cache = false;
+        opts.snapshot = snapshot.get();
+
+        const auto parts = SplitRange(*current, range, threads > 1 ? threads * 4 : 1);
+        Profile total(capacity);
+        std::mutex total_mutex;
+        FirstError error;
+        ParallelFor(parts.size(), threads, [&](size_t i) {
+            auto it = std::unique_ptr<leveldb::Iterator>(current->db->NewIterator(opts));
+            Profile profile(capacity);
+            std::string run;
+            uint64_t run_keys = 0;
+            uint64_t run_bytes = 0;
+            const auto flush = [&] {
+                if (run_keys == 0) return;
+                profile.by_keys.Add(run, run_keys);
+                profile.by_bytes.Add(run, run_bytes);
+            };
+
+            auto status = ScanRange(*it, parts[i], false, [&](leveldb::Iterator& row) {
+                const auto key = SliceToView(row.key());
+                const auto value_size = row.value().size();
+                if (const auto prefix = prefixer(key); run_keys == 0 || prefix != run) {
+                    flush();
+                    run.assign(prefix);
+                    run_keys = 0;
+                    run_bytes = 0;
+                }
+                run_keys++;
+                run_bytes += key.size() + value_size;
+                profile.value_sizes.Record(value_size);
+                profile.keys++;
+                profile.key_bytes += key.size();
+                profile.value_bytes += value_size;
+                return true;
+            });
+            flush();
+            if (!status.ok()) {
+                error.Set(std::move(status));
+                return;
+            }
+
+            std::lock_guard lock(total_mutex);
+            total.Merge(profile);
+        });
+
+        if (error.failed()) return std::unexpected(error.status());
+        return total;
+    }
+
+    static void Print(const Profile& profile, size_t top) {
+        static constexpr auto kRowFmt = "  {:<40}{:>14}{:>8}{}";
+        const auto& sizes = profile.value_sizes;
+        println("{} keys, {} key bytes, {} value bytes", profile.keys, profile.key_bytes, profile.value_bytes);
+        println("value size: min {} p50 {} p90 {} p99 {} max {} mean {:.1f}",
+                sizes.min(),
+                sizes.Percentile(50),
+                sizes.Percentile(90),
+                sizes.Percentile(99),
+                sizes.max(),
+                sizes.Mean());
+
+        const auto table = [&](std::string_view title, const SpaceSaving& sketch, uint64_t total) {
+            println("");
+            println("top {} prefixes by {}:", top, title);
+            std::string scratch;
+            for (const auto& entry : sketch.Top(top)) {
+                const auto share =
+                    total == 0 ? 0.0 : 100.0 * static_cast<double>(entry.weight) / static_cast<double>(total);
+                println(kRowFmt,
+                        DecodeForDisplay(key_codec, entry.item, scratch),
+                        entry.weight,
+                        std::format("{:.1f}%", share),
+                        entry.error == 0 ? std::string() : std::format(" (at most {} over)", entry.error));
+            }
+        };
+        table("keys", profile.by_keys, profile.keys);
+        table("bytes", profile.by_bytes, profile.key_bytes + profile.value_bytes);
+    }
+};
+
+struct SetFunctor {
+    void operator()(const ArgsVector& args) const {
+        auto setting = args[0];
+        if (setting == "sync") {
+            SetSync(args);
+            return;
+        }
+        if (setting == "keycodec" || setting == "valcodec") {
+            SetCodec(args, setting == "keycodec" ? key_codec : value_codec);
+            return;
+        }
+        PrintError("set unknown setting '{}'", setting);
+    }
+
+    static void SetCodec(const ArgsVector& args, CodecSpec& spec) {
+        auto codec = enchantum::cast<Codec>(args[1]);
+        if (!codec) {
+            PrintError("set {} unknown codec '{}', one of:", args[0], args[1]);
+            enchantum::for_each<Codec>([](auto c) {
+                const auto& info = kCodecInfos[static_cast<size_t>(c.value)];
+                println("  {:<10}{}", enchantum::to_string(c.value), info.description);
+            });
+            return;
+        }
+        if ((*codec == Codec::tuple) != (args.size() == 3)) {
+            PrintError(
+                "set {} {} {}", args[0], args[1], *codec == Codec::tuple ? "requires a schema" : "takes no schema");
+            return;
+        }
+
+        // Jobs decode and encode with the session codecs as they run
+        ReapJobs();
+        if (!jobs.empty()) {
+            PrintError("set {} not allowed while background jobs run, wait for them or cancel them", args[0]);
+            return;
+        }
+
+        CodecSpec parsed{*codec, {}};
+        if (*codec == Codec::tuple) {
+            for (auto schema = args[2]; !schema.empty();) {
+                const auto comma = std::min(schema.find(','), schema.size());
+                const auto name = schema.substr(0, comma);
+                schema.remove_prefix(std::min(comma + 1, schema.size()));
+                auto element = enchantum::cast<TupleElement>(name);
+                if (!element) {
+                    PrintError("set {} unknown tuple element '{}'", args[0], name);
+                    return;
+                }
+                if (!parsed.schema.empty() && TupleWidth(parsed.schema.back()) == 0) {
+                    PrintError("set {} {} must be the last tuple element",
+                               args[0],
+                               enchantum::to_string(parsed.schema.back()));
+                    return;
+                }
+                parsed.schema.push_back(*element);
+            }
+        }
+        spec = std::move(parsed);
+        println("OK");
+    }
+
+    static void SetSync(const ArgsVector& args) {
+        auto mode = enchantum::cast<SyncMode>(args[1]);
+        if (!mode) {
+            PrintError("set sync expected off|on|every <n>|interval <ms> got '{}'", args[1]);
+            return;
+        }
+
+        const bool grouped = *mode == SyncMode::every || *mode == SyncMode::interval;
+        if (grouped != (args.size() == 3)) {
+            PrintError("set sync {} {}", args[1], grouped ? "requires a value" : "takes no value");
+            return;
+        }
+
+        uint64_t value = 0;
+        if (grouped) {
+            auto parsed = ParseNumber<uint64_t>(args[2], "set sync");
+            if (!parsed) return;
+            if (*parsed == 0) {
+                PrintError("set sync {} must be greater than 0", args[1]);
+                return;
+            }
+            value = *parsed;
+        }
+
+        // Close the group of the previous policy before switching
+        SyncPendingGroup();
+        std::lock_guard lock(durability.mutex);
+        durability.mode = *mode;
+        durability.every = *mode == SyncMode::every ? value : 0;
+        durability.interval = std::chrono::milliseconds(*mode == SyncMode::interval ? value : 0);
+        println("OK");
+    }
+};
+
+struct StatsFunctor {
+    void operator()() const {
+        print("sync: {}", enchantum::to_string(durability.mode));  // Only changed by the main thread
+        if (durability.mode == SyncMode::every) print(" {}", durability.every);
+        if (durability.mode == SyncMode::interval) print(" {}ms", durability.interval.count());
+        println("");
+        println("codecs: key {}, value {}", CodecName(key_codec), CodecName(value_codec));
+        {
+            std::lock_guard lock(durability.mutex);
+            println("writes: {} ops, {} fsyncs, {} ops pending sync",
+                    durability.ops,
+                    durability.syncs,
+                    durability.unsynced_ops);
+        }
+
+        PrintSnapshotAge();
+        PrintCommandLatency();
+        if (current != nullptr) PrintDatabaseProperties();
+    }
+
+    // Compactions keep every version a snapshot can see, so a forgotten one makes the db grow without bound
+    static void PrintSnapshotAge() {
+        static constexpr std::chrono::seconds kLongHeld{60};
+        for (const auto& handle : handles) {
+            if (handle->snapshot == nullptr) continue;
+            const auto held = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() -
+                                                                               handle->snapshot_taken);
+            println("snapshot: {} held for {}s", handle->name, held.count());
+            if (held >= kLongHeld) {
+                println("warning: the snapshot keeps compactions from dropping data overwritten or deleted since it "
+                        "was taken, release it when done");
+            }
+        }
+    }
+
+    static void PrintCommandLatency() {
+        static constexpr auto kRowFmt = "{:<15}{:>10}{:>12}{:>12}{:>12}{:>12}";
+        const auto ms = [](double nanos) { return std::format("{:.3f}", nanos / 1e6); };
+
+        println("");
+        println(kRowFmt, "Instruction", "Count", "Mean ms", "P50 ms", "P99 ms", "Max ms");
+        enchantum::for_each<Instruction>([&](auto c) {
+            const auto& latency = command_latency[static_cast<size_t>(c.value)];
+            if (latency.count() == 0) return;
+            println(kRowFmt, InstructionName(c.value), latency.count(), ms(latency.Mean()),
+                    ms(static_cast<double>(latency.Percentile(50))), ms(static_cast<double>(latency.Percentile(99))),
+                    ms(static_cast<double>(latency.max())));
+        });
+    }
+
+    static void PrintDatabaseProperties() {
+        std::string value;
+        for (const auto* property : {"leveldb.stats", "leveldb.sstables", "leveldb.approximate-memory-usage"}) {
+            value.clear();
+            if (!current->db->GetProperty(property, &value)) continue;
+            println("\n{}:", property);
+            // stats and sstables already end with a newline
+            print("{}", value);
+            if (!value.ends_with('\n')) println("");
+        }
+    }
+};
+
+struct TimingFunctor {
+    void operator()(const ArgsVector& args) const {
+        if (args[0] != "on" && args[0] != "off") {
+            PrintError("timing expected on|off got '{}'", args[0]);
+            return;
+        }
+        print_timing = args[0] == "on";
+        println("OK");
+    }
+};
+
+template <typename F>
+constexpr auto WrapNoArgs() {
+    return +[](const ArgsVector&) { F()(); };
+}
+
+template <typename F>
+constexpr auto Wrap() {
+    return +[](const ArgsVector& args) { F()(args); };
+}
+
+constexpr auto ViewToSlice(std::string_view view) -> leveldb::Slice { return {view.data(), view.size()}; }
+auto SliceToView(const leveldb::Slice& slice) -> std::string_view { return {slice.data(), slice.size()}; }
+
+template <typename T>
+auto CommandArgs::GetNumber(std::string_view name, T fallback) const -> std::optional<T> {
+    auto value = Get(name);
+    if (!value) return fallback;
+    return ParseNumber<T>(*value, name);
+}
+
+auto ParseCommandArgs(const ArgsVector& args,
+                      std::initializer_list<std::string_view> switches,
+                      std::initializer_list<std::string_view> valued) -> std::optional<CommandArgs> {
+    CommandArgs result;
+    for (size_t i = 0; i < args.size(); i++) {
+        const auto arg = args[i];
+        if (!arg.starts_with("--")) {
+            result.positional.push_back(arg);
+            continue;
+        }
+
+        if (arg == "--") {
+            // Everything after a lone -- is positional, for keys that start with dashes
+            result.positional.insert(result.positional.end(), args.begin() + i + 1, args.end());
+            break;
+        }
+
+        if (std::ranges::find(switches, arg) != switches.end()) {
+            result.options.emplace_back(arg, std::string_view{});
+            continue;
+        }
+
+        if (std::ranges::find(valued, arg) == valued.end()) {
+            PrintError("unknown option '{}'", arg);
+            return std::nullopt;
+        }
+
+        if (i + 1 == args.size()) {
+            PrintError("option '{}' requires a value", arg);
+            return std::nullopt;
+        }
+        result.options.emplace_back(arg, args[++i]);
+    }
+    return result;
+}
+
+// One entry per instruction in any order, kInstructionInfos and kNameTable are derived from it at compile time
+constexpr auto kInstructionTable = std::to_array<std::pair<Instruction, InstructionInfo>>({
+    {Instruction::help, InstructionInfo("Print this help message", {}, WrapNoArgs<PrintHelpFunctor>(), false, "?")},
+     {Instruction::exit, InstructionInfo("Exit the repl", {}, WrapNoArgs<ExitFunctor>(), false, "quit q")},
+     {Instruction::close,
+      InstructionInfo("Close the current or the named database", {.data = "[name]", .size = 0, .optional = 1},
+                      Wrap<CloseFunctor>())},
+     {Instruction::open,
+      InstructionInfo("Open database",
+                      {.data = "[name] path [--copy] [--cache-mb n] ...", .size = 1, .optional = 14},
+                      Wrap<OpenFunctor>())},
+     {Instruction::read,
+      InstructionInfo("Read value from db",
+                      {.data = "key [--head n] [--offset n] [--hex] [--out file]", .size = 1, .optional = 7},
+                      Wrap<ReadFunctor>(), true, "get")},
+     {Instruction::write,
+      InstructionInfo("Write value to db", {.data = "key value", .size = 2}, Wrap<WriteFunctor>(), true, "w put",
+                      true)},
+     {Instruction::dump, InstructionInfo("Print all items in db", {}, WrapNoArgs<DumpFunctor>(), true)},
+     {Instruction::remove,
+      InstructionInfo("Remove an item from db", {.data = "key", .size = 1}, Wrap<RemoveFunctor>(), true, "rm del",
+                      true)},
+     {Instruction::begin,
+      InstructionInfo("Collect writes and removes into one batch",
+                      {.data = "[--max-ops n] [--max-bytes n]", .size = 0, .optional = 4},
+                      Wrap<BeginFunctor>(),
+                      true,
+                      {},
+                      true)},
+     {Instruction::commit,
+      InstructionInfo("Apply the batch with a single sync", {}, WrapNoArgs<CommitFunctor>(), true, {}, true)},
+     {Instruction::rollback, InstructionInfo("Discard the batch", {}, WrapNoArgs<RollbackFunctor>(), true)},
+     {Instruction::set,
+      InstructionInfo("Change a session setting",
+                      {.data = "sync off|on|every <n>|interval <ms> | keycodec|valcodec <codec> [schema]",
+                       .size = 2,
+                       .optional = 1},
+                      Wrap<SetFunctor>())},
+     {Instruction::stats, InstructionInfo("Print session statistics", {}, WrapNoArgs<StatsFunctor>())},
+     {Instruction::import,
+      InstructionInfo("Bulk load csv, tsv or ndjson records",
+                      {.data = "path|- [--format csv|tsv|ndjson] [--direct [--sorted] [--threads n] [--memory-mb n] "
+                               "[--table-mb n]] [&]",
+                       .size = 1,
+                       .optional = 15},
+                      Wrap<ImportFunctor>(),
+                      true,
+                      {},
+                      true,
+                      true)},
+     {Instruction::export_,
+      InstructionInfo("Stream all records to a file",
+                      {.data = "path|- [--format text|csv|tsv|ndjson] [&]", .size = 1, .optional = 5},
+                      Wrap<ExportFunctor>(),
+                      true,
+                      {},
+                      false,
+                      true)},
+     {Instruction::scan,
+      InstructionInfo("Print records in [start, end)",
+                      {.data = "start [end] [--limit n] [--reverse] [--keys-only|--count] [--where pred]",
+                       .size = 1,
+                       .optional = 8},
+                      Wrap<ScanFunctor>(),
+                      true)},
+     {Instruction::prefix,
+      InstructionInfo("Print records starting with prefix",
+                      {.data = "prefix [--limit n] [--reverse] [--keys-only|--count] [--where pred]",
+                       .size = 1,
+                       .optional = 7},
+                      Wrap<PrefixFunctor>(),
+                      true)},
+     {Instruction::bench,
+      InstructionInfo("Benchmark the open db (fill/delete modify it)",
+                      {.data = "name [--num n] [--value-size n] [--threads n]", .size = 1, .optional = 6},
+                      Wrap<BenchFunctor>(), true)},
+     {Instruction::timing,
+      InstructionInfo("Print elapsed time after each command", {.data = "on|off", .size = 1},
+                      Wrap<TimingFunctor>())},
+     {Instruction::mget,
+      InstructionInfo("Read many keys under one snapshot",
+                      {.data = "key... | --file path [--threads n]",
+                       .size = 1,
+                       .optional = InstructionInfo::Arguments::kUnbounded},
+                      Wrap<MultiGetFunctor>(), true)},
+     {Instruction::count,
+      InstructionInfo("Count keys in [start, end)",
+                      {.data = "[start] [end] [--estimate] [--threads n] [&]", .size = 0, .optional = 6},
+                      Wrap<CountFunctor>(), true, {}, false, true)},
+     {Instruction::compact,
+      InstructionInfo("Compact [start, end], before / after files per level",
+                      {.data = "[start] [end] [&]", .size = 0, .optional = 3},
+                      Wrap<CompactFunctor>(), true, {}, false, true)},
+     {Instruction::size,
+      InstructionInfo("Approximate on-disk bytes of [start, end)", {.data = "start end", .size = 2},
+                      Wrap<SizeFunctor>(), true)},
+     {Instruction::delrange,
+      InstructionInfo("Delete all keys in [start, end)",
+                      {.data = "start end [--chunk n] [--dry-run] [--compact] [&]", .size = 2, .optional = 5},
+                      Wrap<DeleteRangeFunctor>(), true, {}, true, true)},
+     {Instruction::delprefix,
+      InstructionInfo("Delete all keys starting with prefix",
+                      {.data = "prefix [--chunk n] [--dry-run] [--compact] [&]", .size = 1, .optional = 5},
+                      Wrap<DeletePrefixFunctor>(), true, {}, true, true)},
+     {Instruction::snapshot,
+      InstructionInfo("Pin a snapshot for all following reads", {}, WrapNoArgs<SnapshotFunctor>(), true)},
+     {Instruction::release,
+      InstructionInfo("Release the pinned snapshot", {}, WrapNoArgs<ReleaseFunctor>(), true)},
+     {Instruction::use,
+      InstructionInfo("Send later commands to the named database, list them without a name",
+                      {.data = "[name]", .size = 0, .optional = 1}, Wrap<UseFunctor>())},
+     {Instruction::diff,
+      InstructionInfo("Keys only in the current db (-), only in @name (+) or changed (~)",
+                      {.data = "@name [start] [end] [--limit n] [--count] [&]", .size = 1, .optional = 8},
+                      Wrap<DiffFunctor>(), true, {}, false, true)},
+     {Instruction::analyze,
+      InstructionInfo("Top key prefixes by count and bytes and value size percentiles of [start, end)",
+                      {.data = "[start] [end] [--prefix-depth n | --delimiter c] [--top k] [--threads n] [&]",
+                       .size = 0,
+                       .optional = 9},
+                      Wrap<AnalyzeFunctor>(), true, {}, false, true)},
+     {Instruction::jobs,
+      InstructionInfo("List background jobs with their progress", {}, WrapNoArgs<JobsFunctor>())},
+     {Instruction::cancel,
+      InstructionInfo("Stop a background job at its next check", {.data = "id", .size = 1}, Wrap<CancelFunctor>())},
+     {Instruction::backup,
+      InstructionInfo("Consistent copy of the open db, sharing tables through hard links",
+                      {.data = "dir [--incremental] [&]", .size = 1, .optional = 2},
+                      Wrap<BackupFunctor>(), true, {}, false, true)},
+     {Instruction::watch,
+      InstructionInfo("Print records added, changed or removed under a prefix as they are written",
+                      {.data = "prefix [--interval ms] [--count n] [&]", .size = 1, .optional = 5},
+                      Wrap<WatchFunctor>(), true, {}, false, true)},
+     {Instruction::repair,
+      InstructionInfo("Rebuild an unopenable db from its tables and logs with RepairDB",
+                      {.data = "path", .size = 1},
+                      Wrap<RepairFunctor>())},
+     {Instruction::verify,
+      InstructionInfo("Read every table with checksums verified, in parallel",
+                      {.data = "[--paranoid] [--threads n]", .size = 0, .optional = 3},
+                      Wrap<VerifyFunctor>(), true)}});
+
+constexpr size_t kInstructionCount = enchantum::count<Instruction>;
+
+constexpr auto kInstructionInfos = MakeDenseTable(kInstructionTable);
+
+constexpr auto GetInfo(Instruction inst) -> const InstructionInfo& {
+    return kInstructionInfos[static_cast<size_t>(inst)];
+}
+
+// Instructions named after C++ keywords carry a trailing underscore in the enum
+constexpr auto InstructionName(Instruction inst) -> std::string_view {
+    auto name = enchantum::to_string(inst);
+    if (name.ends_with('_')) name.remove_suffix(1);
+    return name;
+}
+
+struct NameEntry {
+    std::string_view name;
+    Instruction instruction;
+};
+
+// Calls fn(index, name, instruction) for every full name and alias in kInstructionTable
+constexpr void ForEachName(auto&& fn) {
+    size_t index = 0;
+    for (const auto& [inst, info] : kInstructionTable) {
+        fn(index++, InstructionName(inst), inst);
+        for (auto aliases = info.aliases; !aliases.empty();) {
+            const auto space = std::min(aliases.find(' '), aliases.size());
+            if (space != 0) fn(index++, aliases.substr(0, space), inst);
+            aliases.remove_prefix(std::min(space + 1, aliases.size()));
+        }
+    }
+}
+
+// Full names and aliases, then every abbreviation that only one instruction's names start with. Writes to out
+// unless it is null and returns the number of entries.
+constexpr auto CollectNames(NameEntry* out) -> size_t {
+    size_t count = 0;
+    const auto add = [&](std::string_view name, Instruction inst) {
+        if (out != nullptr) out[count] = {name, inst};
+        count++;
+    };
+    ForEachName([&](size_t, std::string_view name, Instruction inst) { add(name, inst); });
+    ForEachName([&](size_t index, std::string_view name, Instruction inst) {
+        for (size_t length = 1; length < name.size(); length++) {
+            const auto abbreviation = name.substr(0, length);
+            bool usable = true;
+            ForEachName([&](size_t other_index, std::string_view other, Instruction other_inst) {
+                if (!other.starts_with(abbreviation)) return;
+                // Taken by another name, ambiguous, or already added for an earlier name of this instruction
+                if (other == abbreviation || other_inst != inst || other_index < index) usable = false;
+            });
+            if (usable) add(abbreviation, inst);
+        }
+    });
+    return count;
+}
+
+constexpr size_t kNameCount = CollectNames(nullptr);
+constexpr auto kNames = [] {
+    std::array<NameEntry, kNameCount> names{};
+    CollectNames(names.data());
+    for (size_t i = 0; i < names.size(); i++) {
+        for (size_t j = i + 1; j < names.size(); j++) {
+            if (names[i].name == names[j].name) throw "name used by two instructions";
+        }
+    }
+    return names;
+}();
+
+constexpr auto HashName(std::string_view name, uint64_t seed) -> uint64_t {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (const char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+// Hash and displace perfect hash over kNames: seed 0 picks a bucket, the bucket's own seed then sends each of its
+// names to a distinct slot, so a lookup is two hashes and one compare
+struct NameTable {
+    static constexpr size_t kBuckets = std::bit_ceil(kNameCount / 4 + 1);
+    static constexpr size_t kSlots = std::bit_ceil(kNameCount * 2);
+    static constexpr uint16_t kEmpty = std::numeric_limits<uint16_t>::max();
+    static_assert(kNameCount < kEmpty);
+
+    std::array<uint16_t, kBuckets> seeds{};
+    std::array<uint16_t, kSlots> slots{};
+};
+
+constexpr auto kNameTable = [] {
+    NameTable table;
+    table.slots.fill(NameTable::kEmpty);
+    std::array<size_t, NameTable::kBuckets> bucket_sizes{};
+    for (const auto& entry : kNames) bucket_sizes[HashName(entry.name, 0) & (NameTable::kBuckets - 1)]++;
+
+    // Largest buckets first while most slots are still free
+    std::array<size_t, kNameCount> placed{};
+    for (size_t size = std::ranges::max(bucket_sizes); size > 0; size--) {
+        for (size_t bucket = 0; bucket < NameTable::kBuckets; bucket++) {
+            if (bucket_sizes[bucket] != size) continue;
+
+            bool done = false;
+            for (uint16_t seed = 1; !done; seed++) {
+                if (seed == NameTable::kEmpty) throw "no seed places every name of the bucket";
+                size_t count = 0;
+                done = true;
+                for (size_t i = 0; i < kNames.size() && done; i++) {
+                    if ((HashName(kNames[i].name, 0) & (NameTable::kBuckets - 1)) != bucket) continue;
+                    const auto slot = HashName(kNames[i].name, seed) & (NameTable::kSlots - 1);
+                    const auto taken = std::ranges::find(placed.begin(), placed.begin() + count, slot);
+                    done = table.slots[slot] == NameTable::kEmpty && taken == placed.begin() + count;
+                    placed[count++] = slot;
+                }
+                if (!done) continue;
+
+                table.seeds[bucket] = seed;
+                for (size_t i = 0; i < kNames.size(); i++) {
+                    if ((HashName(kNames[i].name, 0) & (NameTable::kBuckets - 1)) != bucket) continue;
+                    table.slots[HashName(kNames[i].name, seed) & (NameTable::kSlots - 1)] = static_cast<uint16_t>(i);
+                }
+            }
+        }
+    }
+    return table;
+}();
+
+constexpr auto ParseInstruction(std::string_view name) -> std::optional<Instruction> {
+    const auto bucket = HashName(name, 0) & (NameTable::kBuckets - 1);
+    const auto slot = HashName(name, kNameTable.seeds[bucket]) & (NameTable::kSlots - 1);
+    const auto index = kNameTable.slots[slot];
+    if (index == NameTable::kEmpty || kNames[index].name != name) return std::nullopt;
+    return kNames[index].instruction;
+}
+
+static_assert(ParseInstruction("write") == Instruction::write);
+static_assert(ParseInstruction("w") == Instruction::write);
+static_assert(ParseInstruction("export") == Instruction::export_);
+static_assert(!ParseInstruction("export_"));
+
+// Whether the first argument is an @name that sends the command to that database. diff takes the other side as its
+// own first @name, so only a second one routes it: diff @a @b compares a with b.
+constexpr auto RoutesFirstArgument(Instruction inst, ArgsVector args) -> bool {
+    if (args.empty() || !args[0].starts_with('@')) return false;
+    return inst != Instruction::diff || (args.size() > 1 && args[1].starts_with('@'));
+}
+
+static_assert(RoutesFirstArgument(Instruction::scan, std::array<std::string_view, 2>{"@shadow", "a"}));
+static_assert(!RoutesFirstArgument(Instruction::diff, std::array<std::string_view, 1>{"@shadow"}));
+static_assert(!RoutesFirstArgument(Instruction::diff, std::array<std::string_view, 3>{"@shadow", "a", "z"}));
+static_assert(RoutesFirstArgument(Instruction::diff, std::array<std::string_view, 2>{"@a", "@b"}));
+
+void PrintInvalidStateError(Instruction inst, std::string_view requirement) {
+    PrintError("{} requires {}", InstructionName(inst), requirement);
+}
+
+void PrintSizeMismatchError(Instruction inst, const InstructionInfo::Arguments& expected, size_t actual) {
+    if (expected.optional == 0) {
+        PrintError("{} expected {} arguments got {}", InstructionName(inst), expected.size, actual);
+        return;
+    }
+    if (expected.optional == InstructionInfo::Arguments::kUnbounded) {
+        PrintError("{} expected at least {} arguments got {}", InstructionName(inst), expected.size, actual);
+        return;
+    }
+    PrintError("{} expected {} to {} arguments got {}",
+               InstructionName(inst),
+               expected.size,
+               expected.size + expected.optional,
+               actual);
+}
+
+void PrintSyntaxError(std::string_view input, size_t pos, std::string_view error_msg) {
+    size_t length = pos + 1;
+    PrintError("{}\n{}\n{:>{}}{:~^{}}", error_msg, input, '^', length, "", input.size() - length);
+}
+
+// Returns the first space, tab, quote or backslash in [p, end), or end. Lines of at least one vector width are
+// scanned 32 or 16 bytes at a time, the tail and short lines byte by byte. Constant evaluation takes the byte loop.
+constexpr auto FindSpecial(const char* p, const char* end) -> const char* {
+    if !consteval {
+#if defined(__AVX2__)
+        const auto space32 = _mm256_set1_epi8(' ');
+        const auto tab32 = _mm256_set1_epi8('\t');
+        const auto dquote32 = _mm256_set1_epi8('"');
+        const auto squote32 = _mm256_set1_epi8('\'');
+        const auto backslash32 = _mm256_set1_epi8('\\');
+        for (; end - p >= 32; p += 32) {
+            const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            const auto hits = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space32), _mm256_cmpeq_epi8(chunk, tab32)),
+                _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, dquote32), _mm256_cmpeq_epi8(chunk, squote32)),
+                                _mm256_cmpeq_epi8(chunk, backslash32)));
+            if (const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(hits))) return p + std::countr_zero(mask);
+        }
+#endif
+#if defined(__SSE2__)
+        const auto space = _mm_set1_epi8(' ');
+        const auto tab = _mm_set1_epi8('\t');
+        const auto dquote = _mm_set1_epi8('"');
+        const auto squote = _mm_set1_epi8('\'');
+        const auto backslash = _mm_set1_epi8('\\');
+        for (; end - p >= 16; p += 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const auto hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, dquote), _mm_cmpeq_epi8(chunk, squote)),
+                             _mm_cmpeq_epi8(chunk, backslash)));
+            if (const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(hits))) return p + std::countr_zero(mask);
+        }
+#elif defined(__ARM_NEON)
+        for (; end - p >= 16; p += 16) {
+            const auto chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+            const auto blanks = vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(' ')), vceqq_u8(chunk, vdupq_n_u8('\t')));
+            const auto quotes = vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('"')), vceqq_u8(chunk, vdupq_n_u8('\'')));
+            const auto hits = vorrq_u8(vorrq_u8(blanks, quotes), vceqq_u8(chunk, vdupq_n_u8('\\')));
+            // Narrow every byte of the comparison to a nibble, giving a 64-bit mask with 4 bits per input byte
+            const auto nibbles = vshrn_n_u16(vreinterpretq_u16_u8(hits), 4);
+            if (const auto mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0)) return p + std::countr_zero(mask) / 4;
+        }
+#endif
+    }
+    for (; p != end; p++) {
+        if (*p == ' ' || *p == '\t' || *p == '"' || *p == '\'' || *p == '\\') break;
+    }
+    return p;
+}
+
+// Argument array with inline room for the usual handful of arguments, spilling to the heap only for long ones
+class ArgBuffer {
+public:
+    static constexpr size_t kInline = 16;
+
+    constexpr void clear() {
+        size_ = 0;
+        heap_.clear();
+    }
+
+    constexpr void push_back(std::string_view arg) {
+        if (size_ < kInline) {
+            inline_[size_++] = arg;
+            return;
+        }
+        if (size_ == kInline) heap_.assign(inline_.begin(), inline_.end());
+        heap_.push_back(arg);
+        size_++;
+    }
+
+    constexpr auto view() const -> ArgsVector {
+        if (size_ <= kInline) return {inline_.data(), size_};
+        return heap_;
+    }
+
+private:
+    std::array<std::string_view, kInline> inline_;
+    std::vector<std::string_view> heap_;
+    size_t size_ = 0;
+};
+
+// Splits a line into arguments with shell-like quoting: arguments are separated by spaces or tabs, single quotes keep
+// their content literally and double quotes or unquoted text resolve backslash escapes (\n \t \r \0 \xHH, or any
+// other character to drop its special meaning). Arguments are written into storage that is reused for every line,
+// so after the first few lines parsing does not allocate. The returned views stay valid until the next Parse.
+class CommandParser {
+public:
+    constexpr auto Parse(std::string_view input) -> std::optional<ArgsVector> {
+        // Quotes and escapes only ever shrink the input, so it always fits
+        storage_.resize(input.size());
+        out_ = storage_.data();
+        args_.clear();
+
+        const char* p = input.data();
+        const char* const end = p + input.size();
+        for (;;) {
+            while (p != end && (*p == ' ' || *p == '\t')) p++;
+            if (p == end) break;
+
+            const char* const arg = out_;
+            while (p != end) {
+                const char* special = FindSpecial(p, end);
+                Copy(p, special);
+                p = special;
+                if (p == end || *p == ' ' || *p == '\t') break;
+
+                if (*p == '\\') {
+                    p = Unescape(p + 1, end);
+                } else if (*p == '\'') {
+                    const auto close = std::string_view(p + 1, end).find('\'');
+                    if (close == std::string_view::npos) return SyntaxError(input, p);
+                    Copy(p + 1, p + 1 + close);
+                    p += close + 2;
+                } else if (*p == '"') {
+                    auto close = ParseDoubleQuoted(p + 1, end);
+                    if (close == nullptr) return SyntaxError(input, p);
+                    p = close + 1;
+                }
+            }
+            args_.push_back({arg, static_cast<size_t>(out_ - arg)});
+        }
+        return args_.view();
+    }
+
+private:
+    constexpr void Copy(const char* begin, const char* end) { out_ = std::copy(begin, end, out_); }
+
+    // Copies up to the closing quote and returns it, or nullptr if the quote is never closed
+    constexpr auto ParseDoubleQuoted(const char* p, const char* end) -> const char* {
+        while (p != end) {
+            const char* special = FindSpecial(p, end);
+            Copy(p, special);
+            p = special;
+            if (p == end) break;
+            if (*p == '"') return p;
+            if (*p == '\\') {
+                p = Unescape(p + 1, end);
+            } else {
+                *out_++ = *p++;  // Spaces and single quotes are plain text here
+            }
+        }
+        return nullptr;
+    }
+
+    // p points behind a backslash, returns the position after the escape
+    constexpr auto Unescape(const char* p, const char* end) -> const char* {
+        if (p == end) {
+            *out_++ = '\\';
+            return p;
+        }
+
+        switch (*p) {
+            case 'n':
+                *out_++ = '\n';
+                return p + 1;
+            case 't':
+                *out_++ = '\t';
+                return p + 1;
+            case 'r':
+                *out_++ = '\r';
+                return p + 1;
+            case '0':
+                *out_++ = '\0';
+                return p + 1;
+            case 'x': {
+                uint8_t byte = 0;
+                if (end - p >= 3) {
+                    const auto [ptr, ec] = std::from_chars(p + 1, p + 3, byte, 16);
+                    if (ec == std::errc() && ptr == p + 3) {
+                        *out_++ = static_cast<char>(byte);
+                        return p + 3;
+                    }
+                }
+                break;
+            }
+            default:
+                if ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')) break;
+                *out_++ = *p;  // Escaped space, quote, backslash or other punctuation
+                return p + 1;
+        }
+
+        // Unknown escapes are kept as written
+        *out_++ = '\\';
+        *out_++ = *p;
+        return p + 1;
+    }
+
+    // Silent in constant evaluation, where only the outcome is checked
+    static constexpr auto SyntaxError(std::string_view input, const char* quote) -> std::nullopt_t {
+        if !consteval {
+            const char* message =
+                *quote == '"' ? "Expected double quotes to be closed" : "Expected quotes to be closed";
+            PrintSyntaxError(input, quote - input.data(), message);
+        }
+        return std::nullopt;
+    }
+
+    std::string storage_;
+    char* out_ = nullptr;
+    ArgBuffer args_;
+};
+
+constexpr auto SplitsInto(std::string_view line, std::initializer_list<std::string_view> expected) -> bool {
+    CommandParser parser;
+    const auto args = parser.Parse(line);
+    return args && std::ranges::equal(*args, expected);
+}
+
+static_assert(SplitsInto("  put\tk  v ", {"put", "k", "v"}));
+static_assert(SplitsInto("", {}));
+static_assert(SplitsInto(R"(w 'a b' "c d" e\ f)", {"w", "a b", "c d", "e f"}));
+static_assert(SplitsInto(R"(w '' "" x'')", {"w", "", "", "x"}));
+static_assert(SplitsInto(R"(w a"b c"'d e'f)", {"w", "ab cd ef"}));
+static_assert(SplitsInto(R"(w 'a\n"b' "a'b\"c\\")", {"w", R"(a\n"b)", R"(a'b"c\)"}));
+static_assert(SplitsInto(R"(w \n\t\r "\n")", {"w", "\n\t\r", "\n"}));
+static_assert(SplitsInto(R"(w \x41\x7a \x4g \x4 \q \')", {"w", "Az", R"(\x4g)", R"(\x4)", R"(\q)", "'"}));
+static_assert(SplitsInto(R"(w "\x00")", {"w", std::string_view("\0", 1)}));
+static_assert(SplitsInto(R"(w a\)", {"w", R"(a\)"}));
+static_assert(!SplitsInto(R"(w "a\)", {"w"}));
+static_assert(!SplitsInto("w 'a", {"w"}));
+
+// Switches back after an @name command, unless the command closed the previous database
+struct RestoreCurrent {
+    Handle* previous;
+
+    ~RestoreCurrent() {
+        const bool open = std::ranges::any_of(handles, [&](const auto& handle) { return handle.get() == previous; });
+        current = open ? previous : nullptr;
+    }
+};
+
+// Runs the command on its own thread against the current database. Its output goes to the terminal as it is
+// produced, a last line reports how it ended.
+void StartJob(Instruction instruction, std::string_view line, const ArgsVector& args) {
+    ReapJobs();
+    auto& job = *jobs.emplace_back(std::make_unique<Job>());
+    job.id = next_job_id++;
+    const auto space = std::string_view(" \t");
+    line = line.substr(0, line.find_last_not_of(space) + 1);
+    job.command = line.substr(0, line.substr(0, line.size() - 1).find_last_not_of(space) + 1);  // Without the &
+    job.handle = current;
+    job.args.assign(args.begin(), args.end());
+    job.cancellable = instruction != Instruction::compact;
+
+    job.thread = std::jthread([&job, instruction] {
+        current = job.handle;
+        current_job = &job;
+        const std::vector<std::string_view> args(job.args.begin(), job.args.end());
+        GetInfo(instruction).impl(args);
+        if (GetInfo(instruction).writes) write_generation++;
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.started).count();
+        const auto outcome = job.cancel ? "cancelled" : thread_error_count != 0 ? "failed" : "done";
+        println("[{}] {} {} after {:.2f}s, {} rows, {:.1f} MB/s",
+                job.id,
+                outcome,
+                job.command,
+                seconds,
+                job.rows.load(),
+                seconds > 0 ? static_cast<double>(job.bytes.load()) / (1 << 20) / seconds : 0.0);
+        job.finished = true;
+    });
+    println("[{}] {}", job.id, job.command);
+}
+
+// Parses and dispatches one line, returns false if the command reported an error
+auto Execute(std::string_view line) -> bool {
+    static thread_local CommandParser parser;
+    SyncDueGroup();
+    const auto errors_before = error_count.load();
+    auto parsed = parser.Parse(line);
+    if (!parsed) return false;
+    if (parsed->empty()) return true;
+
+    const auto instruction = ParseInstruction(parsed->front());
+    if (!instruction) {
+        error_count++;
+        println("Unknown instruction '{}' !", parsed->front());
+        return false;
+    }
+    auto args = parsed->subspan(1);  // Drop the instruction
+
+    // @name sends just this command to another open database, an @word naming none stays an argument
+    std::optional<RestoreCurrent> restore;
+    if (RoutesFirstArgument(*instruction, args)) {
+        if (auto* handle = FindHandle(args[0].substr(1))) {
+            restore.emplace(current);
+            current = handle;
+            args = args.subspan(1);
+        }
+    }
+
+    // A trailing & runs commands that allow it as a background job, for any other it is an argument
+    auto& info = GetInfo(*instruction);
+    const bool background = info.background && !args.empty() && args.back() == "&";
+    if (background) args = args.first(args.size() - 1);
+
+    if (info.require_db && current == nullptr) {
+        PrintInvalidStateError(*instruction, "Opened Database");
+        return false;
+    }
+    if (info.writes && current != nullptr && current->read_only) {
+        PrintInvalidStateError(*instruction, "a writable database, this one was opened with --copy");
+        return false;
+    }
+
+    if (!info.args.data.empty() &&
+        (args.size() < info.args.size || args.size() - info.args.size > info.args.optional)) {
+        PrintSizeMismatchError(*instruction, info.args, args.size());
+        return false;
+    }
+
+    if (background) {
+        StartJob(*instruction, line, args);
+        return true;
+    }
+
+    Job foreground;
+    current_job = &foreground;
+    foreground_job = &foreground;
+    const auto start = std::chrono::steady_clock::now();
+    info.impl(args);
+    if (info.writes) write_generation++;
+    foreground_job = nullptr;
+    current_job = nullptr;
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    command_latency[static_cast<size_t>(*instruction)].Record(nanos);
+    if (print_timing) {
+        println("Run Time: {:.3f} ms", static_cast<double>(nanos) / 1e6);
+    }
+    return error_count == errors_before;
+}
+
+// Runs every line of file without prompts, blank lines and lines starting with # are skipped
+void ExecuteScript(std::FILE* file) {
+    LineReader reader(file);
+    while (auto line = reader.Next()) {
+        if (line->empty() || line->front() == '#') continue;
+        Execute(*line);
+        ExitOnInterrupt();
+    }
+    if (reader.error()) {
+        PrintError("reading script failed '{}'", std::strerror(errno));
+    }
+}
+
+auto CommonPrefix(std::string_view a, std::string_view b) -> std::string_view {
+    const auto mismatch = std::ranges::mismatch(a, b);
+    return a.substr(0, static_cast<size_t>(mismatch.in1 - a.begin()));
+}
+
+// Key completions of a prefix from a Seek and at most kCandidates + 1 keys, plus one more Seek for the last key under
+// the prefix when there are more. A prefix matching millions of keys costs the same as one matching a few. Results
+// are cached per db and snapshot until the next write, the least recently used entry goes first.
+class KeyCompleter {
+public:
+    static constexpr size_t kCandidates = 32;
+    static constexpr size_t kCacheSize = 64;
+
+    struct Completion {
+        std::string common;             // Shared by every key starting with the prefix
+        std::vector<std::string> keys;  // The first kCandidates of them
+        bool more = false;
+    };
+
+    auto Complete(const Handle& handle, std::string_view prefix) -> const Completion& {
+        const auto generation = write_generation.load();
+        const auto hit = std::ranges::find_if(cache_, [&](const Entry& entry) {
+            return entry.handle == &handle && entry.snapshot == handle.snapshot && entry.generation == generation &&
+                   entry.prefix == prefix;
+        });
+        if (hit != cache_.end()) {
+            std::rotate(cache_.begin(), hit, hit + 1);
+        } else {
+            if (cache_.size() == kCacheSize) cache_.pop_back();
+            cache_.insert(cache_.begin(),
+                          {&handle, handle.snapshot, generation, std::string(prefix), Lookup(handle, prefix)});
+        }
+        return cache_.front().completion;
+    }
+
+private:
+    struct Entry {
+        const Handle* handle;
+        const leveldb::Snapshot* snapshot;
+        uint64_t generation;
+        std::string prefix;
+        Completion completion;
+    };
+
+    static auto Lookup(const Handle& handle, std::string_view prefix) -> Completion {
+        Completion completion;
+        auto it = std::unique_ptr<leveldb::Iterator>(handle.db->NewIterator(SessionReadOptions(handle)));
+        for (it->Seek(ViewToSlice(prefix)); it->Valid() && SliceToView(it->key()).starts_with(prefix); it->Next()) {
+            if (completion.keys.size() == kCandidates) {
+                completion.more = true;
+                break;
+            }
+            completion.keys.emplace_back(SliceToView(it->key()));
+        }
+        if (completion.keys.empty()) return completion;
+        if (!completion.more) {
+            completion.common = CommonPrefix(completion.keys.front(), completion.keys.back());
+            return completion;
+        }
+
+        // Keys are sorted, whatever the first and the last key under the prefix share every key between them shares
+        const auto range = KeyRange::Prefix(prefix);
+        if (range.end) it->Seek(*range.end);
+        if (range.end && it->Valid()) {
+            it->Prev();
+        } else {
+            it->SeekToLast();
+        }
+        if (it->Valid()) completion.common = CommonPrefix(completion.keys.front(), SliceToView(it->key()));
+        return completion;
+    }
+
+    std::vector<Entry> cache_;  // Most recently used first
+};
+
+// Line editing for the interactive prompt: cursor movement, Emacs style kill keys, history kept across sessions and
+// Tab completion of instruction names and, with the raw key codec, keys of the current db. A second Tab lists the
+// candidates. Input that is not a terminal is read line by line without any of it.
+class LineEditor {
+public:
+    static constexpr size_t kHistorySize = 1000;
+
+    explicit LineEditor(fs::path history_path)
+        : history_path_(std::move(history_path)),
+          terminal_(isatty(STDIN_FILENO) != 0 && isatty(STDOUT_FILENO) != 0) {
+        LoadHistory();
+    }
+
+    // nullopt at the end of input or on Ctrl-D at an empty line
+    auto ReadLine(std::string_view prompt) -> std::optional<std::string> {
+        if (!terminal_ || !EnterRawMode()) {
+            print("{}", prompt);
+            std::fflush(stdout);
+            std::string line;
+            for (auto c = ReadByte(); c != '\n'; c = ReadByte()) {
+                if (!c) return line.empty() ? std::nullopt : std::optional(std::move(line));
+                line.push_back(*c);
+            }
+            return line;
+        }
+
+        prompt_ = prompt;
+        line_.clear();
+        cursor_ = 0;
+        history_index_ = history_.size();
+        bool repeated_tab = false;
+        Refresh();
+        for (;;) {
+            const auto c = ReadByte();
+            if (!c || (*c == kCtrlD && line_.empty())) {
+                RestoreTerminal();
+                return std::nullopt;
+            }
+            const bool tab = *c == '\t';
+            if (!HandleKey(*c, repeated_tab)) {
+                RestoreTerminal();
+                print("\n");
+                return std::move(line_);
+            }
+            repeated_tab = tab;
+        }
+    }
+
+    // Appended to the history file right away, so lines survive a session that ends with Ctrl-C
+    void AddHistory(std::string_view line) {
+        if (line.empty() || (!history_.empty() && history_.back() == line)) return;
+        history_.emplace_back(line);
+        if (history_.size() > kHistorySize) history_.erase(history_.begin());
+        if (history_path_.empty()) return;
+        FilePtr file(std::fopen(history_path_.c_str(), "a"), &std::fclose);
+        if (file != nullptr) std::fprintf(file.get(), "%.*s\n", static_cast<int>(line.size()), line.data());
+    }
+
+private:
+    static constexpr char kCtrlD = 4;
+    static constexpr char kEscape = 27;
+
+    // nullopt at the end of input and once SIGINT wrote to interrupt_pipe. Wakes up to sync a due interval group
+    // while the user is idle.
+    static auto ReadByte() -> std::optional<char> {
+        std::array<pollfd, 2> fds = {pollfd{.fd = STDIN_FILENO, .events = POLLIN, .revents = 0},
+                                     pollfd{.fd = interrupt_pipe[0], .events = POLLIN, .revents = 0}};
+        for (;;) {
+            const auto due = durability.UntilDue();
+            const auto timeout = due ? std::min<int64_t>(std::chrono::ceil<std::chrono::milliseconds>(*due).count(),
+                                                         std::numeric_limits<int>::max())
+                                     : -1;
+            const auto ready = poll(fds.data(), interrupt_pipe[0] >= 0 ? 2 : 1, static_cast<int>(timeout));
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                return std::nullopt;
+            }
+            if (ready == 0) {
+                SyncDueGroup();
+                continue;
+            }
+            if (fds[1].revents != 0 || interrupted) return std::nullopt;
+            char c;
+            const auto n = read(STDIN_FILENO, &c, 1);
+            if (n == 1) return c;
+            if (n < 0 && errno == EINTR) continue;
+            return std::nullopt;
+        }
+    }
+
+    // Terminal settings restored after each line and at exit, SIGINT at the prompt exits through std::exit
+    static inline termios saved_terminal_{};
+    static inline bool raw_ = false;
+
+    static auto EnterRawMode() -> bool {
+        static const bool registered = std::atexit(RestoreTerminal) == 0;
+        if (!registered || tcgetattr(STDIN_FILENO, &saved_terminal_) != 0) return false;
+        termios raw = saved_terminal_;
+        raw.c_iflag &= ~(ICRNL | IXON);
+        raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);  // ISIG stays, Ctrl-C still raises SIGINT
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) return false;
+        raw_ = true;
+        return true;
+    }
+
+    static void RestoreTerminal() {
+        if (raw_) tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_terminal_);
+        raw_ = false;
+    }
+
+    // Returns false once the line is complete
+    auto HandleKey(char c, bool repeated_tab) -> bool {
+        switch (c) {
+            case '\r':
+            case '\n':
+                cursor_ = line_.size();
+                Refresh();
+                return false;
+            case '\t':
+                Complete(repeated_tab);
+                return true;
+            case 127:
+            case '\b':
+                if (cursor_ > 0) {
+                    const auto from = Previous(cursor_);
+                    line_.erase(from, cursor_ - from);
+                    cursor_ = from;
+                }
+                break;
+            case kCtrlD:
+                if (cursor_ < line_.size()) line_.erase(cursor_, Next(cursor_) - cursor_);
+                break;
+            case 1:  // Ctrl-A
+                cursor_ = 0;
+                break;
+            case 5:  // Ctrl-E
+                cursor_ = line_.size();
+                break;
+            case 2:  // Ctrl-B
+                cursor_ = Previous(cursor_);
+                break;
+            case 6:  // Ctrl-F
+                cursor_ = Next(cursor_);
+                break;
+            case 11:  // Ctrl-K
+                line_.erase(cursor_);
+                break;
+            case 21:  // Ctrl-U
+                line_.erase(0, cursor_);
+                cursor_ = 0;
+                break;
+            case 23: {  // Ctrl-W, the word before the cursor and the spaces after it
+                auto from = cursor_;
+                while (from > 0 && line_[from - 1] == ' ') from--;
+                while (from > 0 && line_[from - 1] != ' ') from--;
+                line_.erase(from, cursor_ - from);
+                cursor_ = from;
+                break;
+            }
+            case 12:  // Ctrl-L
+                print("\x1b[H\x1b[2J");
+                break;
+            case 16:  // Ctrl-P
+                History(-1);
+                break;
+            case 14:  // Ctrl-N
+                History(1);
+                break;
+            case kEscape:
+                HandleEscape();
+                break;
+            default:
+                if (static_cast<uint8_t>(c) < ' ') return true;
+                line_.insert(cursor_, 1, c);
+                cursor_++;
+                break;
+        }
+        Refresh();
+        return true;
+    }
+
+    // CSI and SS3 sequences of the arrow, Home, End and Delete keys
+    void HandleEscape() {
+        const auto kind = ReadByte();
+        if (kind != '[' && kind != 'O') return;
+        auto code = ReadByte();
+        char digit = '\0';
+        if (code && *code >= '0' && *code <= '9') {
+            digit = *code;
+            code = ReadByte();
+            if (code != '~') return;
+        }
+        if (!code) return;
+        switch (digit != '\0' ? digit : *code) {
+            case 'A':
+                History(-1);
+                break;
+            case 'B':
+                History(1);
+                break;
+            case 'C':
+                cursor_ = Next(cursor_);
+                break;
+            case 'D':
+                cursor_ = Previous(cursor_);
+                break;
+            case 'H':
+            case '1':
+            case '7':
+                cursor_ = 0;
+                break;
+            case 'F':
+            case '4':
+            case '8':
+                cursor_ = line_.size();
+                break;
+            case '3':
+                if (cursor_ < line_.size()) line_.erase(cursor_, Next(cursor_) - cursor_);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // The line being typed is kept while browsing and comes back below the newest entry
+    void History(int step) {
+        if (step < 0 && history_index_ == 0) return;
+        if (step > 0 && history_index_ == history_.size()) return;
+        if (history_index_ == history_.size()) draft_ = line_;
+        history_index_ += step;
+        line_ = history_index_ == history_.size() ? draft_ : history_[history_index_];
+        cursor_ = line_.size();
+    }
+
+    // Cursor steps skip UTF-8 continuation bytes so a multibyte character moves as one
+    static auto Continuation(char c) -> bool { return (static_cast<uint8_t>(c) & 0xC0) == 0x80; }
+
+    auto Previous(size_t pos) const -> size_t {
+        if (pos == 0) return 0;
+        pos--;
+        while (pos > 0 && Continuation(line_[pos])) pos--;
+        return pos;
+    }
+
+    auto Next(size_t pos) const -> size_t {
+        if (pos == line_.size()) return pos;
+        pos++;
+        while (pos < line_.size() && Continuation(line_[pos])) pos++;
+        return pos;
+    }
+
+    void Refresh() const {
+        size_t column = prompt_.size();
+        for (size_t i = 0; i < cursor_; i++) column += Continuation(line_[i]) ? 0 : 1;
+        std::string out = "\r";
+        out += prompt_;
+        out += line_;
+        out += "\x1b[K\r";
+        if (column != 0) out += std::format("\x1b[{}C", column);
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        std::fflush(stdout);
+    }
+
+    // Completes the word before the cursor as far as every candidate agrees, the first word is an instruction
+    void Complete(bool list) {
+        auto start = cursor_;
+        while (start > 0 && line_[start - 1] != ' ') start--;
+        const auto word = std::string_view(line_).substr(start, cursor_ - start);
+
+        std::vector<std::string> candidates;
+        std::string common;
+        bool more = false;
+        if (line_.find_first_not_of(' ') >= start) {
+            ForEachName([&](size_t, std::string_view name, Instruction) {
+                if (name.starts_with(word)) candidates.emplace_back(name);
+            });
+            std::ranges::sort(candidates);
+            if (!candidates.empty()) common = CommonPrefix(candidates.front(), candidates.back());
+        } else if (current != nullptr && current->db != nullptr && key_codec.codec == Codec::raw &&
+                   word.find_first_of("\"'\\") == std::string_view::npos) {
+            // Typed keys are unescaped by the command parser, so only plain words are looked up as they are
+            const auto& completion = keys_.Complete(*current, word);
+            candidates = completion.keys;
+            common = completion.common;
+            more = completion.more;
+        }
+        if (candidates.empty()) {
+            print("\a");
+            return;
+        }
+
+        // Stops at bytes the command parser would split on or unescape, such keys are typed on by hand
+        const auto plain = std::ranges::find_if(common, [](char c) {
+            return static_cast<uint8_t>(c) <= ' ' || c == '"' || c == '\'' || c == '\\' || c == 127;
+        });
+        common.erase(plain, common.end());
+        const bool unique = candidates.size() == 1 && !more && common == candidates.front();
+        if (common.size() > word.size() || unique) {
+            auto insert = common.substr(word.size());
+            if (unique && (cursor_ == line_.size() || line_[cursor_] != ' ')) insert += ' ';
+            line_.insert(cursor_, insert);
+            cursor_ += insert.size();
+            Refresh();
+            return;
+        }
+        if (!list) {
+            print("\a");
+            return;
+        }
+
+        std::string out = "\n";
+        for (const auto& candidate : candidates) {
+            out += candidate;
+            out += '\n';
+        }
+        if (more) out += "...\n";
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        Refresh();
+    }
+
+    void LoadHistory() {
+        if (history_path_.empty()) return;
+        FilePtr file(std::fopen(history_path_.c_str(), "rb"), &std::fclose);
+        if (file == nullptr) return;
+        LineReader reader(file.get());
+        size_t lines = 0;
+        while (auto line = reader.Next()) {
+            if (line->empty()) continue;
+            lines++;
+            history_.emplace_back(*line);
+            if (history_.size() > 2 * kHistorySize) history_.erase(history_.begin(), history_.end() - kHistorySize);
+        }
+        if (history_.size() > kHistorySize) history_.erase(history_.begin(), history_.end() - kHistorySize);
+
+        // The file only grows while running, it is cut back to the kept entries once it holds twice as many
+        if (lines <= 2 * kHistorySize) return;
+        file.reset(std::fopen(history_path_.c_str(), "wb"));
+        if (file == nullptr) return;
+        for (const auto& line : history_) std::fprintf(file.get(), "%s\n", line.c_str());
+    }
+
+    fs::path history_path_;
+    bool terminal_;
+    std::vector<std::string> history_;
+    size_t history_index_ = 0;
+    std::string draft_;
+    std::string prompt_;
+    std::string line_;
+    size_t cursor_ = 0;
+    KeyCompleter keys_;
+};
+
+auto HistoryPath() -> fs::path {
+    const char* home = std::getenv("HOME");
+    return home != nullptr && *home != '\0' ? fs::path(home) / ".leveldb_repl_history" : fs::path();
+}
+
+void RunInteractive() {
+    LineEditor editor(HistoryPath());
+    println("LevelDB R.E.P.L.");
+    println("Type 'help' for more information.");
+    for (;;) {
+        auto user_input = editor.ReadLine(">>> ");
+        ExitOnInterrupt();
+        if (!user_input) {
+            println("");
+            ExitFunctor()();
+        }
+        if (user_input->empty()) {
+            continue;
+        }
+        editor.AddHistory(*user_input);
+        Execute(*user_input);
+        ExitOnInterrupt();
+    }
+}
+
+void PrintUsage(const char* program) {
+    println(stderr, "Usage: {} [--batch] [-f script] [-c command]...", program);
+    println(stderr, "  --batch       Read commands from stdin without banner or prompt");
+    println(stderr, "  -f script     Run the commands in script, - for stdin");
+    println(stderr, "  -c command    Run command, may be given multiple times");
+    println(stderr, "In these modes the exit code is 1 if any command failed.");
+}
+
+auto main(int argc, char** argv) -> int {
+    // The first interrupt stops the running command at its next check. A second one, or one at the prompt, exits
+    // once the main thread is back between commands, a third one right away. Nothing else is signal safe here.
+    if (pipe2(interrupt_pipe.data(), O_CLOEXEC | O_NONBLOCK) != 0) interrupt_pipe = {-1, -1};
+    struct sigaction action{};
+    action.sa_handler = [](int) {
+        if (auto* job = foreground_job.load(); job != nullptr && !job->cancel.exchange(true)) return;
+        if (interrupted.exchange(true)) _exit(EXIT_FAILURE);
+        if (interrupt_pipe[1] >= 0) {
+            [[maybe_unused]] const auto written = write(interrupt_pipe[1], "", 1);
+        }
+    };
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, nullptr);
+
+    bool batch = false;
+    std::vector<std::string_view> commands;
+    std::optional<std::string_view> script;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "-c" && i + 1 < argc) {
+            commands.emplace_back(argv[++i]);
+        } else if (arg == "-f" && i + 1 < argc) {
+            script = argv[++i];
+        } else {
+            PrintUsage(argv[0]);
+            return arg == "-h" || arg == "--help" ? EXIT_SUCCESS : 2;
+        }
+    }
+
+    if (!batch && commands.empty() && !script) {
+        RunInteractive();
+        return EXIT_SUCCESS;
+    }
+
+    script_mode = true;
+    for (const auto command : commands) {
+        Execute(command);
+        ExitOnInterrupt();
+    }
+
+    if (script && *script != "-") {
+        FilePtr file(std::fopen(std::string(*script).c_str(), "rb"), &std::fclose);
+        if (file == nullptr) {
+            PrintError("{} '{}'", *script, std::strerror(errno));
+        } else {
+            ExecuteScript(file.get());
+        }
+    } else if (script || batch) {
+        ExecuteScript(stdin);
+    }
+
+    WaitForJobs();
+    ExitFunctor()();
+    return EXIT_SUCCESS;
+}